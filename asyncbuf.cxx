@@ -0,0 +1,139 @@
+/*
+ * Output buffer that is written by its own thread.
+ *
+ * Author: Jan Holesovsky <kendy@suse.cz>
+ * License: MIT <http://www.opensource.org/licenses/mit-license.php>
+ */
+
+#include "asyncbuf.hxx"
+
+using namespace std;
+
+AsyncOutBuf::AsyncOutBuf( streambuf* target_ )
+    : target( target_ ),
+      chunk( chunk_size, '\0' ),
+      queued( 0 ),
+      stop( false ),
+      running( false )
+{
+    setp( &chunk[0], &chunk[0] + chunk.size() );
+
+    pthread_mutex_init( &mutex, NULL );
+    pthread_cond_init( &cond, NULL );
+
+    running = ( pthread_create( &thread, NULL, run, this ) == 0 );
+}
+
+AsyncOutBuf::~AsyncOutBuf()
+{
+    drain();
+
+    if ( running )
+    {
+        pthread_mutex_lock( &mutex );
+        stop = true;
+        pthread_cond_broadcast( &cond );
+        pthread_mutex_unlock( &mutex );
+
+        pthread_join( thread, NULL );
+    }
+
+    pthread_cond_destroy( &cond );
+    pthread_mutex_destroy( &mutex );
+}
+
+void AsyncOutBuf::drain()
+{
+    handOff();
+
+    pthread_mutex_lock( &mutex );
+    while ( !queue.empty() )
+        pthread_cond_wait( &cond, &mutex );
+    pthread_mutex_unlock( &mutex );
+
+    // the thread does not touch the target when the queue is empty
+    target->pubsync();
+}
+
+AsyncOutBuf::int_type AsyncOutBuf::overflow( int_type c_ )
+{
+    handOff();
+
+    if ( !traits_type::eq_int_type( c_, traits_type::eof() ) )
+    {
+        *pptr() = traits_type::to_char_type( c_ );
+        pbump( 1 );
+    }
+
+    return traits_type::not_eof( c_ );
+}
+
+int AsyncOutBuf::sync()
+{
+    return 0;
+}
+
+void AsyncOutBuf::handOff()
+{
+    const size_t len = pptr() - pbase();
+    if ( len == 0 )
+        return;
+
+    if ( !running )
+    {
+        target->sputn( pbase(), len );
+        setp( &chunk[0], &chunk[0] + chunk.size() );
+        return;
+    }
+
+    chunk.resize( len );
+
+    pthread_mutex_lock( &mutex );
+
+    while ( queued >= max_queued )
+        pthread_cond_wait( &cond, &mutex );
+
+    queue.push_back( string() );
+    queue.back().swap( chunk );
+    queued += len;
+
+    pthread_cond_broadcast( &cond );
+    pthread_mutex_unlock( &mutex );
+
+    chunk.resize( chunk_size );
+    setp( &chunk[0], &chunk[0] + chunk.size() );
+}
+
+void* AsyncOutBuf::run( void* this_ )
+{
+    static_cast< AsyncOutBuf* >( this_ )->work();
+    return NULL;
+}
+
+void AsyncOutBuf::work()
+{
+    pthread_mutex_lock( &mutex );
+    while ( true )
+    {
+        if ( queue.empty() )
+        {
+            if ( stop )
+                break;
+
+            pthread_cond_wait( &cond, &mutex );
+            continue;
+        }
+
+        // nobody else touches the front one
+        const string& data = queue.front();
+        pthread_mutex_unlock( &mutex );
+
+        target->sputn( data.data(), data.size() );
+
+        pthread_mutex_lock( &mutex );
+        queued -= data.size();
+        queue.pop_front();
+        pthread_cond_broadcast( &cond );
+    }
+    pthread_mutex_unlock( &mutex );
+}
@@ -0,0 +1,80 @@
+/*
+ * Output buffer that is written by its own thread.
+ *
+ * Author: Jan Holesovsky <kendy@suse.cz>
+ * License: MIT <http://www.opensource.org/licenses/mit-license.php>
+ */
+
+#ifndef _ASYNCBUF_HXX_
+#define _ASYNCBUF_HXX_
+
+#include <deque>
+#include <streambuf>
+#include <string>
+
+#include <pthread.h>
+
+/// Collects the output in chunks, and a thread writes them to the target.
+///
+/// So that a slow reader of one repository (git fast-import) does not block
+/// the export of the other ones - we block only when there is too much
+/// waiting for the reader.
+///
+/// sync() (and so std::endl) does not wait for anything, use drain() when
+/// the reader really has to see everything.
+class AsyncOutBuf : public std::streambuf
+{
+    /// Where the thread writes.
+    std::streambuf* target;
+
+    /// The chunk we are filling now.
+    std::string chunk;
+
+    /// Chunks for the thread; the front one is removed only when written.
+    std::deque< std::string > queue;
+
+    /// Size of the chunks in the queue.
+    size_t queued;
+
+    bool stop;
+
+    pthread_t thread;
+
+    /// Did we manage to start the thread?  If not, we write synchronously.
+    bool running;
+
+    pthread_mutex_t mutex;
+
+    /// Signalled when a chunk is added to or removed from the queue.
+    pthread_cond_t cond;
+
+    static const size_t chunk_size = 256*1024;
+
+    /// Wait when there is this much waiting for the target.
+    static const size_t max_queued = 16*1024*1024;
+
+public:
+    AsyncOutBuf( std::streambuf* target_ );
+
+    /// Writes everything, and stops the thread.
+    ~AsyncOutBuf();
+
+    /// Wait until everything is written to the target, and flush it.
+    void drain();
+
+protected:
+    virtual int_type overflow( int_type c_ );
+
+    virtual int sync();
+
+private:
+    /// Pass the current chunk to the thread.
+    void handOff();
+
+    static void* run( void* this_ );
+
+    /// Body of the thread.
+    void work();
+};
+
+#endif // _ASYNCBUF_HXX_
@@ -0,0 +1,93 @@
+/*
+ * Benchmark of the lookup of the branch commits: a synthetic history with
+ * many branches, each branched off an old revision of master, exported by
+ * Repository to bench-branches.dump (no svn needed).
+ *
+ * Author: Jan Holesovsky <kendy@suse.cz>
+ * License: MIT <http://www.opensource.org/licenses/mit-license.php>
+ */
+
+#include "committers.hxx"
+#include "error.hxx"
+#include "repository.hxx"
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include <sys/time.h>
+#include <unistd.h>
+
+using namespace std;
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday( &tv, NULL );
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static string branchName( unsigned int number_ )
+{
+    char name[32];
+    snprintf( name, sizeof( name ), "cws%u", number_ );
+    return name;
+}
+
+int main( int argc, char* argv[] )
+{
+    const unsigned int revs = ( argc > 1 )? atoi( argv[1] ): 200000;
+    const unsigned int branches = ( argc > 2 )? atoi( argv[2] ): 10000;
+    if ( argc > 3 || revs < 1 || branches < 1 )
+    {
+        Error::report( string( "usage: " ) + argv[0] + " [REVISIONS [BRANCHES]]\n\n"
+                "Exports REVISIONS (200000 by default) revisions with BRANCHES\n"
+                "(10000 by default) branches to bench-branches.dump, and prints\n"
+                "the time it took." );
+        return Error::returnValue();
+    }
+
+    // everything goes to one repository
+    char layout[] = "/tmp/bench-branches.XXXXXX";
+    const int fd = mkstemp( layout );
+    if ( fd < 0 || write( fd, "bench-branches=.*\n", 18 ) != 18 )
+    {
+        Error::report( "Cannot create the layout file." );
+        return 1;
+    }
+    close( fd );
+
+    int min_rev = -1;
+    string trunk_base, trunk, branches_dir, tags_dir;
+    const bool loaded = Repositories::load( layout, revs + 1, min_rev, trunk_base, trunk, branches_dir, tags_dir );
+    unlink( layout );
+    if ( !loaded )
+        return 1;
+
+    const Committer committer( "Bench", "bench@example.com" );
+    const double start = now();
+
+    // every 20th revision creates a branch off master from a much older
+    // revision; the other ones commit to master, or to one of the branches
+    unsigned int created = 0;
+    for ( unsigned int rev = 1; rev <= revs; ++rev )
+    {
+        if ( rev % 20 == 0 && created < branches )
+        {
+            ++created;
+            Repositories::createBranchOrTag( true, rev / 2, "master", committer, branchName( created ), rev, Time( time_t( rev ) ), "branch\n" );
+            continue;
+        }
+
+        const string branch( ( rev % 7 == 0 || created == 0 )? string( "master" ): branchName( ( rev * 7919 ) % created + 1 ) );
+        Repositories::modifyFile( "file", "100644" ) << "data 0\n\n";
+        Repositories::commit( committer, branch, rev, Time( time_t( rev ) ), "commit\n" );
+    }
+
+    Repositories::close();
+
+    fprintf( stderr, "%u revisions, %u branches: %.2fs\n", revs, created, now() - start );
+
+    return Error::returnValue();
+}
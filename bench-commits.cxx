@@ -0,0 +1,153 @@
+/*
+ * Benchmark of the output: N small commits exported by Repository into a
+ * pipe (bench-commits.dump is a FIFO), counting the write() calls (no svn
+ * needed).
+ *
+ * Author: Jan Holesovsky <kendy@suse.cz>
+ * License: MIT <http://www.opensource.org/licenses/mit-license.php>
+ */
+
+#include "committers.hxx"
+#include "error.hxx"
+#include "repository.hxx"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+using namespace std;
+
+/// The write() / writev() calls, except those to stderr.
+static unsigned long write_calls = 0;
+
+/// Our write() and writev() replace the ones from libc (also for the
+/// calls from libstdc++), to count the calls.
+extern "C" ssize_t write( int fd_, const void* buf_, size_t count_ )
+{
+    if ( fd_ != STDERR_FILENO )
+        __sync_fetch_and_add( &write_calls, 1 );
+
+    return syscall( SYS_write, fd_, buf_, count_ );
+}
+
+extern "C" ssize_t writev( int fd_, const struct iovec* iov_, int iovcnt_ )
+{
+    if ( fd_ != STDERR_FILENO )
+        __sync_fetch_and_add( &write_calls, 1 );
+
+    return syscall( SYS_writev, fd_, iov_, iovcnt_ );
+}
+
+static const char dump_fname[] = "bench-commits.dump";
+
+/// The other end of the pipe: read everything, count the bytes.
+static void* drain( void* bytes_ )
+{
+    unsigned long long& bytes = *static_cast< unsigned long long* >( bytes_ );
+
+    const int fd = open( dump_fname, O_RDONLY );
+    if ( fd < 0 )
+        return NULL;
+
+    char buffer[65536];
+    ssize_t len;
+    while ( ( len = read( fd, buffer, sizeof( buffer ) ) ) != 0 )
+    {
+        if ( len > 0 )
+            bytes += len;
+        else if ( errno != EINTR )
+            break;
+    }
+    close( fd );
+
+    return NULL;
+}
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday( &tv, NULL );
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+int main( int argc, char* argv[] )
+{
+    const unsigned int commits = ( argc > 1 )? atoi( argv[1] ): 50000;
+    if ( argc > 2 || commits < 1 )
+    {
+        Error::report( string( "usage: " ) + argv[0] + " [COMMITS]\n\n"
+                "Exports COMMITS (50000 by default) small commits into a pipe, and\n"
+                "prints how many write() calls it took; fails when there is one\n"
+                "per commit or more." );
+        return Error::returnValue();
+    }
+
+    // everything goes to one repository
+    char layout[] = "/tmp/bench-commits.XXXXXX";
+    const int fd = mkstemp( layout );
+    if ( fd < 0 || write( fd, "bench-commits=.*\n", 17 ) != 17 )
+    {
+        Error::report( "Cannot create the layout file." );
+        return 1;
+    }
+    close( fd );
+
+    unlink( dump_fname );
+    if ( mkfifo( dump_fname, 0600 ) != 0 )
+    {
+        Error::report( string( "Cannot create the pipe '" ) + dump_fname + "'" );
+        unlink( layout );
+        return 1;
+    }
+
+    unsigned long long bytes = 0;
+    pthread_t reader;
+    pthread_create( &reader, NULL, drain, &bytes );
+
+    // opens the pipe
+    int min_rev = -1;
+    string trunk_base, trunk, branches, tags;
+    const bool loaded = Repositories::load( layout, commits + 1, min_rev, trunk_base, trunk, branches, tags );
+    unlink( layout );
+    if ( !loaded )
+        return 1;
+
+    const Committer committer( "Bench", "bench@example.com" );
+    const unsigned long calls_before = write_calls;
+    const double start = now();
+
+    for ( unsigned int rev = 1; rev <= commits; ++rev )
+    {
+        char fname[32];
+        snprintf( fname, sizeof( fname ), "dir/file%u", rev % 100 );
+
+        Repositories::modifyFile( fname, "100644" ) << "data 6\nline \n\n";
+        Repositories::commit( committer, "master", rev, Time( time_t( rev ) ), "commit\n" );
+    }
+
+    Repositories::close();
+    pthread_join( reader, NULL );
+
+    const double seconds = now() - start;
+    const unsigned long calls = write_calls - calls_before;
+    unlink( dump_fname );
+
+    fprintf( stderr, "%u commits, %llu bytes: %lu write() calls, %.2fs\n", commits, bytes, calls, seconds );
+
+    if ( calls >= commits )
+    {
+        Error::report( "The output is written commit by commit (or more often)." );
+        return 1;
+    }
+
+    return Error::returnValue();
+}
@@ -0,0 +1,161 @@
+/*
+ * Benchmark of the filters: 'make bench-filter' builds it twice, with the
+ * per-byte loops (-DFILTER_PER_BYTE) and with the block search, and checks
+ * that both write the same output.
+ *
+ * Author: Jan Holesovsky <kendy@suse.cz>
+ * License: MIT <http://www.opensource.org/licenses/mit-license.php>
+ */
+
+#include "error.hxx"
+#include "filter.hxx"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+#include <sys/time.h>
+
+using namespace std;
+
+/// The size of the chunks passed to addData() / count() / writeData(), as svn reads them.
+static const size_t chunk_size = 16384;
+
+static const struct {
+    FilterType type;
+    const char* name;
+} filters[] = {
+    { FILTER_OLD,           "old" },
+    { FILTER_COMBINED,      "combined" },
+    { FILTER_COMBINED_DOS,  "combined-dos" },
+    { FILTER_COMBINED_HACK, "combined-hack" },
+    { FILTER_TABS,          "tabs" },
+    { FILTER_DOS,           "dos" },
+    { FILTER_UNX,           "unx" },
+};
+
+static const size_t filters_count = sizeof( filters ) / sizeof( filters[0] );
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday( &tv, NULL );
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/// Something like source code: indented by tabs and spaces, words, a bit of
+/// trailing whitespace, and some DOS line ends; the same every time.
+static string generate( size_t size_ )
+{
+    static const char* words[] = { "if", "( foo )", "return", "bar;", "{", "}", "const", "char*", "=", "x_", "//", "0;" };
+    const size_t words_count = sizeof( words ) / sizeof( words[0] );
+
+    string result;
+    result.reserve( size_ + 256 );
+
+    unsigned int seed = 1;
+    while ( result.size() < size_ )
+    {
+        seed = seed * 1103515245 + 12345;
+        const unsigned int r = seed >> 8;
+
+        result.append( r % 4, '\t' );
+        result.append( ( r >> 2 ) % 3 == 0? 4: 0, ' ' );
+
+        const unsigned int words_in_line = ( r >> 4 ) % 10;
+        for ( unsigned int i = 0; i < words_in_line; ++i )
+        {
+            seed = seed * 1103515245 + 12345;
+            if ( i > 0 )
+                result += ( ( seed >> 8 ) % 16 == 0 )? '\t': ' ';
+            result += words[( seed >> 12 ) % words_count];
+        }
+
+        if ( ( r >> 8 ) % 8 == 0 )
+            result += "  ";
+        if ( ( r >> 11 ) % 16 == 0 )
+            result += '\r';
+        result += '\n';
+    }
+
+    return result;
+}
+
+/// Filter the input_ with addData() & write(), and with the streaming, into out_; the seconds of each go to added_ and streamed_.
+static void run( const char* fname_, const string& input_, ostream& out_, double& added_, double& streamed_ )
+{
+    double start = now();
+    {
+        Filter filter( fname_ );
+        for ( size_t i = 0; i < input_.size(); i += chunk_size )
+            filter.addData( input_.data() + i, min( chunk_size, input_.size() - i ) );
+        filter.write( out_ );
+    }
+    added_ = now() - start;
+
+    start = now();
+    {
+        Filter filter( fname_ );
+        for ( size_t i = 0; i < input_.size(); i += chunk_size )
+            filter.count( input_.data() + i, min( chunk_size, input_.size() - i ) );
+        filter.writeHeader( out_ );
+        for ( size_t i = 0; i < input_.size(); i += chunk_size )
+            filter.writeData( out_, input_.data() + i, min( chunk_size, input_.size() - i ) );
+        filter.writeFooter( out_ );
+    }
+    streamed_ = now() - start;
+}
+
+int main( int argc, char* argv[] )
+{
+    if ( argc < 2 || argc > 3 )
+    {
+        Error::report( string( "usage: " ) + argv[0] + " OUTPUT [INPUT]\n\n"
+                "Filters INPUT (or generated source code) with each of the filters,\n"
+                "writes the results to OUTPUT, and prints the speed." );
+        return Error::returnValue();
+    }
+
+    string input;
+    if ( argc == 3 )
+    {
+        ifstream file( argv[2], ios_base::in | ios_base::binary );
+        if ( !file )
+        {
+            Error::report( string( "Cannot read '" ) + argv[2] + "'" );
+            return Error::returnValue();
+        }
+        ostringstream content;
+        content << file.rdbuf();
+        input = content.str();
+    }
+    else
+        input = generate( 8*1024*1024 );
+
+    ofstream out( argv[1], ios_base::out | ios_base::binary | ios_base::trunc );
+
+    for ( size_t i = 0; i < filters_count; ++i )
+        Filter::addTabsToSpaces( 8, filters[i].type, string( "^" ) + filters[i].name + "$" );
+
+    const double mb = input.size() / ( 1024.0 * 1024.0 );
+    fprintf( stderr, "%-14s %12s %12s\n", "filter", "addData", "streamed" );
+    for ( size_t i = 0; i < filters_count; ++i )
+    {
+        double added, streamed;
+        run( filters[i].name, input, out, added, streamed );
+        fprintf( stderr, "%-14s %7.0f MB/s %7.0f MB/s\n", filters[i].name, mb / added, mb / streamed );
+    }
+
+    out.close();
+    if ( !out )
+    {
+        Error::report( string( "Cannot write '" ) + argv[1] + "'" );
+        return 1;
+    }
+
+    return Error::returnValue();
+}
@@ -0,0 +1,270 @@
+/*
+ * Run git fast-import as our child process.
+ *
+ * Author: Jan Holesovsky <kendy@suse.cz>
+ * License: MIT <http://www.opensource.org/licenses/mit-license.php>
+ */
+
+#include "error.hxx"
+#include "fastimport.hxx"
+
+#include <cerrno>
+#include <climits>
+#include <cstring>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char **environ;
+
+using namespace std;
+
+/// The fd where fast-import writes the answers to 'ls' and 'cat-blob'.
+#define CAT_BLOB_FD 3
+
+FdOutBuf::FdOutBuf()
+    : fd( -1 ),
+      buffer( new char[buffer_size] ),
+      failed( false )
+{
+    setp( buffer, buffer + buffer_size );
+}
+
+FdOutBuf::~FdOutBuf()
+{
+    flushBuffer();
+    delete[] buffer;
+}
+
+FdOutBuf::int_type FdOutBuf::overflow( int_type c_ )
+{
+    if ( !flushBuffer() )
+        return traits_type::eof();
+
+    if ( !traits_type::eq_int_type( c_, traits_type::eof() ) )
+    {
+        *pptr() = traits_type::to_char_type( c_ );
+        pbump( 1 );
+    }
+
+    return traits_type::not_eof( c_ );
+}
+
+int FdOutBuf::sync()
+{
+    return flushBuffer()? 0: -1;
+}
+
+bool FdOutBuf::flushBuffer()
+{
+    const char* data = pbase();
+    size_t len = pptr() - pbase();
+
+    while ( len > 0 && fd >= 0 && !hasFailed() )
+    {
+        ssize_t written = ::write( fd, data, len );
+        if ( written < 0 )
+        {
+            if ( errno == EINTR )
+                continue;
+
+            // report just once, the rest goes nowhere
+            Error::report( string( "Writing to git fast-import failed: " ) + strerror( errno ) );
+            __atomic_store_n( &failed, true, __ATOMIC_RELEASE );
+            break;
+        }
+
+        data += written;
+        len -= written;
+    }
+
+    setp( buffer, buffer + buffer_size );
+
+    return !hasFailed();
+}
+
+/// Start the process, return its pid (or -1).
+static pid_t spawn( const char* const argv_[], posix_spawn_file_actions_t* actions_ )
+{
+    // in its own process group, a ^C in the terminal is for us to handle;
+    // it must not kill git fast-import in the middle of the stream
+    posix_spawnattr_t attr;
+    posix_spawnattr_init( &attr );
+    posix_spawnattr_setflags( &attr, POSIX_SPAWN_SETPGROUP );
+    posix_spawnattr_setpgroup( &attr, 0 );
+
+    pid_t pid;
+    int status = posix_spawnp( &pid, argv_[0], actions_, &attr, const_cast< char* const* >( argv_ ), environ );
+
+    posix_spawnattr_destroy( &attr );
+    if ( status != 0 )
+    {
+        Error::report( string( "Cannot start '" ) + argv_[0] + "': " + strerror( status ) );
+        return -1;
+    }
+
+    return pid;
+}
+
+/// Wait for the process, return its exit status.
+static int waitFor( pid_t pid_ )
+{
+    int status;
+    while ( waitpid( pid_, &status, 0 ) < 0 )
+    {
+        if ( errno != EINTR )
+            return -1;
+    }
+
+    if ( WIFEXITED( status ) )
+        return WEXITSTATUS( status );
+
+    return -1;
+}
+
+FastImport::FastImport( const string& git_dir_, const string& marks_ )
+    : pid( -1 ),
+      to_child( -1 ),
+      from_child( -1 )
+{
+    // when fast-import dies, we want an error from write(), not to be killed
+    signal( SIGPIPE, SIG_IGN );
+
+    const char* init_argv[] = { "git", "init", "-q", git_dir_.c_str(), NULL };
+    pid_t init_pid = spawn( init_argv, NULL );
+    if ( init_pid < 0 || waitFor( init_pid ) != 0 )
+    {
+        Error::report( "Cannot initialize git repository '" + git_dir_ + "'" );
+        return;
+    }
+
+    int stream_pipe[2], answer_pipe[2];
+    if ( pipe( stream_pipe ) != 0 )
+    {
+        Error::report( string( "Cannot create pipe: " ) + strerror( errno ) );
+        return;
+    }
+    if ( pipe( answer_pipe ) != 0 )
+    {
+        Error::report( string( "Cannot create pipe: " ) + strerror( errno ) );
+        ::close( stream_pipe[0] );
+        ::close( stream_pipe[1] );
+        return;
+    }
+
+    // none of the other children should inherit these, otherwise they would
+    // keep the pipes open; dup2() in the child clears the flag again
+    fcntl( stream_pipe[0], F_SETFD, FD_CLOEXEC );
+    fcntl( stream_pipe[1], F_SETFD, FD_CLOEXEC );
+    fcntl( answer_pipe[0], F_SETFD, FD_CLOEXEC );
+    fcntl( answer_pipe[1], F_SETFD, FD_CLOEXEC );
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init( &actions );
+    posix_spawn_file_actions_adddup2( &actions, stream_pipe[0], 0 );
+    posix_spawn_file_actions_adddup2( &actions, answer_pipe[1], CAT_BLOB_FD );
+
+    // fast-import runs in git_dir_
+    string marks( marks_ );
+    if ( !marks.empty() && marks[0] != '/' )
+    {
+        char cwd[PATH_MAX];
+        if ( getcwd( cwd, sizeof( cwd ) ) )
+            marks = string( cwd ) + "/" + marks;
+    }
+    string import_marks( "--import-marks-if-exists=" + marks );
+    string export_marks( "--export-marks=" + marks );
+
+    // the refs are on the disk after every checkpoint, but a branch that
+    // is created again later does not continue the old one
+    const char* argv[] = { "git", "-C", git_dir_.c_str(), "fast-import", "--force", "--cat-blob-fd=3", NULL, NULL, NULL };
+    if ( !marks.empty() )
+    {
+        argv[6] = import_marks.c_str();
+        argv[7] = export_marks.c_str();
+    }
+    pid = spawn( argv, &actions );
+
+    posix_spawn_file_actions_destroy( &actions );
+
+    ::close( stream_pipe[0] );
+    ::close( answer_pipe[1] );
+
+    if ( pid < 0 )
+    {
+        ::close( stream_pipe[1] );
+        ::close( answer_pipe[0] );
+        return;
+    }
+
+    to_child = stream_pipe[1];
+    from_child = answer_pipe[0];
+    out_buf.setFd( to_child );
+}
+
+FastImport::~FastImport()
+{
+    finish();
+}
+
+string FastImport::readLine()
+{
+    size_t eol;
+    while ( ( eol = answers.find( '\n' ) ) == string::npos )
+    {
+        char buffer[4096];
+        ssize_t len = ::read( from_child, buffer, sizeof( buffer ) );
+        if ( len < 0 && errno == EINTR )
+            continue;
+
+        if ( len <= 0 )
+        {
+            Error::report( "git fast-import did not answer." );
+            string result;
+            result.swap( answers );
+            return result;
+        }
+
+        answers.append( buffer, len );
+    }
+
+    string result( answers, 0, eol );
+    answers.erase( 0, eol + 1 );
+
+    return result;
+}
+
+const char* FastImport::syncCommand()
+{
+    // 'ls' in the empty tree (that every git knows) just answers 'missing'
+    return "ls 4b825dc642cb6eb9a060e54bf8d69288fbee4904 sync\n";
+}
+
+bool FastImport::isSyncAnswer( const string& answer_ )
+{
+    return answer_ == "missing sync";
+}
+
+int FastImport::finish()
+{
+    if ( pid < 0 )
+        return -1;
+
+    out_buf.pubsync();
+    out_buf.setFd( -1 );
+
+    ::close( to_child );
+    ::close( from_child );
+    to_child = from_child = -1;
+
+    int status = waitFor( pid );
+    pid = -1;
+
+    if ( status != 0 )
+        Error::report( "git fast-import failed." );
+
+    return status;
+}
@@ -0,0 +1,101 @@
+/*
+ * Run git fast-import as our child process.
+ *
+ * Author: Jan Holesovsky <kendy@suse.cz>
+ * License: MIT <http://www.opensource.org/licenses/mit-license.php>
+ */
+
+#ifndef _FASTIMPORT_HXX_
+#define _FASTIMPORT_HXX_
+
+#include <streambuf>
+#include <string>
+
+#include <sys/types.h>
+
+/// Buffered output to a file descriptor.
+class FdOutBuf : public std::streambuf
+{
+    int fd;
+
+    char* buffer;
+
+    /// Writing failed (the reader died).
+    ///
+    /// Set by the thread that writes (of AsyncOutBuf), read by the main
+    /// thread; so only through the __atomic builtins.
+    bool failed;
+
+    static const size_t buffer_size = 65536;
+
+public:
+    FdOutBuf();
+
+    ~FdOutBuf();
+
+    void setFd( int fd_ ) { fd = fd_; }
+
+    bool hasFailed() const { return __atomic_load_n( &failed, __ATOMIC_ACQUIRE ); }
+
+protected:
+    virtual int_type overflow( int_type c_ );
+
+    virtual int sync();
+
+private:
+    bool flushBuffer();
+};
+
+/// git fast-import that reads the stream from us, and answers the 'ls' and
+/// 'cat-blob' commands via --cat-blob-fd.
+class FastImport
+{
+    /// The process.
+    pid_t pid;
+
+    /// Where we write the stream.
+    int to_child;
+
+    /// Where we read the answers.
+    int from_child;
+
+    FdOutBuf out_buf;
+
+    /// Answers read, but not consumed yet.
+    std::string answers;
+
+public:
+    /// Create (if needed) the git repository in git_dir_, and start git fast-import there.
+    ///
+    /// When marks_ is not empty, fast-import loads the marks from that file
+    /// (if it exists), and saves them there at every checkpoint.
+    FastImport( const std::string& git_dir_, const std::string& marks_ = std::string() );
+
+    ~FastImport();
+
+    /// Did we manage to start the process?
+    bool isRunning() const { return pid > 0; }
+
+    /// Has the process died under our hands?
+    bool hasFailed() const { return out_buf.hasFailed(); }
+
+    /// The stream buffer to write the commands to.
+    std::streambuf* rdbuf() { return &out_buf; }
+
+    /// Read one line of the answer (without the trailing \n).
+    std::string readLine();
+
+    /// The command to send when we want to know that fast-import has
+    /// processed everything before it; see isSyncAnswer().
+    static const char* syncCommand();
+
+    /// Is this the answer to syncCommand()?
+    static bool isSyncAnswer( const std::string& answer_ );
+
+    /// Close the stream, and wait for the process to finish.
+    ///
+    /// Returns the exit status.
+    int finish();
+};
+
+#endif // _FASTIMPORT_HXX_
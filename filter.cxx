@@ -7,48 +7,56 @@
 
 #include "error.hxx"
 #include "filter.hxx"
-
-#include <regex.h>
+#include "pathregex.hxx"
 
 #include <cstring>
 #include <cstdio>
 #include <iostream>
 #include <vector>
 
+#include <pthread.h>
+
+#if defined( __GNUC__ ) && defined( __SSE2__ )
+#define FILTER_SSE2 1
+#include <immintrin.h>
+#endif
+
 using namespace std;
 
 struct Tabs {
     int spaces;
     FilterType type;
     FilePermission perm;
-    regex_t regex;
+    PathRegex regex;
 
     Tabs( int spaces_, FilterType type_, FilePermission perm_ ) : spaces( spaces_ ), type( type_ ), perm( perm_ ) {}
-    ~Tabs() { regfree( &regex ); }
-
-    bool matches( const string& fname_ ) { return regexec( &regex, fname_.c_str(), 0, NULL, 0 ) == 0; }
 };
 
 static std::vector< Tabs* > tabs_vector;
+static PathRegexList tabs_rules; // regexes of tabs_vector, in the same order
+static pthread_mutex_t tabs_rules_mutex = PTHREAD_MUTEX_INITIALIZER; // the prefetching threads filter too
 
 Filter::Filter( const string& fname_ )
     : spaces( 0 ),
       column( 0 ),
       spaces_to_write( 0 ),
       nonspace_appeared( false ),
-      type( NO_FILTER )
+      type( NO_FILTER ),
+      perm( PERMISSION_NO_CHANGE ),
+      rule( -1 ),
+      counted( 0 )
 {
     data.reserve( 16384 );
 
-    for ( std::vector< Tabs* >::const_iterator it = tabs_vector.begin(); it != tabs_vector.end(); ++it )
+    // 1st wins
+    pthread_mutex_lock( &tabs_rules_mutex );
+    rule = tabs_rules.firstMatch( fname_ );
+    pthread_mutex_unlock( &tabs_rules_mutex );
+    if ( rule >= 0 )
     {
-        if ( (*it)->matches( fname_.c_str() ) )
-        {
-            spaces = (*it)->spaces;
-            type = (*it)->type;
-            perm = (*it)->perm;
-            break; // 1st wins
-        }
+        spaces = tabs_vector[rule]->spaces;
+        type = tabs_vector[rule]->type;
+        perm = tabs_vector[rule]->perm;
     }
 }
 
@@ -239,55 +247,208 @@ inline void addDataLoopUnx( char*& dest, char what, int& column, int& spaces_to_
     *dest++ = what;
 }
 
-void Filter::addData( const char* data_, size_t len_ )
+/// Bit mask of the special_ characters (there are always 4 of them) in the 32 bytes of block_.
+typedef unsigned int (*SpecialMask)( const char* block_, const char* special_ );
+
+#if defined( FILTER_SSE2 )
+static inline unsigned int specialMaskSse2( const char* block_, const char* special_ )
 {
-    if ( type == NO_FILTER )
+    const __m128i a = _mm_set1_epi8( special_[0] );
+    const __m128i b = _mm_set1_epi8( special_[1] );
+    const __m128i c = _mm_set1_epi8( special_[2] );
+    const __m128i d = _mm_set1_epi8( special_[3] );
+
+    unsigned int mask = 0;
+    for ( int i = 0; i < 32; i += 16 )
     {
-        data.append( data_, len_ );
+        const __m128i x = _mm_loadu_si128( reinterpret_cast< const __m128i* >( block_ + i ) );
+        const __m128i found = _mm_or_si128( _mm_or_si128( _mm_cmpeq_epi8( x, a ), _mm_cmpeq_epi8( x, b ) ),
+                                            _mm_or_si128( _mm_cmpeq_epi8( x, c ), _mm_cmpeq_epi8( x, d ) ) );
+        mask |= static_cast< unsigned int >( _mm_movemask_epi8( found ) ) << i;
+    }
+
+    return mask;
+}
+
+__attribute__(( target( "avx2" ) ))
+static inline unsigned int specialMaskAvx2( const char* block_, const char* special_ )
+{
+    const __m256i x = _mm256_loadu_si256( reinterpret_cast< const __m256i* >( block_ ) );
+    const __m256i found = _mm256_or_si256(
+            _mm256_or_si256( _mm256_cmpeq_epi8( x, _mm256_set1_epi8( special_[0] ) ), _mm256_cmpeq_epi8( x, _mm256_set1_epi8( special_[1] ) ) ),
+            _mm256_or_si256( _mm256_cmpeq_epi8( x, _mm256_set1_epi8( special_[2] ) ), _mm256_cmpeq_epi8( x, _mm256_set1_epi8( special_[3] ) ) ) );
+
+    return _mm256_movemask_epi8( found );
+}
+
+static const bool has_avx2 = ( __builtin_cpu_init(), __builtin_cpu_supports( "avx2" ) );
+#else
+static inline unsigned int specialMaskScalar( const char* block_, const char* special_ )
+{
+    unsigned int mask = 0;
+    for ( int i = 0; i < 32; ++i )
+    {
+        const char c = block_[i];
+        if ( c == special_[0] || c == special_[1] || c == special_[2] || c == special_[3] )
+            mask |= 1u << i;
+    }
+
+    return mask;
+}
+#endif
+
+typedef void (*AddDataLoop)( char*& dest, char what, int& column, int& spaces_to_write, bool& nonspace_appeared, int no_spaces );
+
+/// Run of ordinary characters [from_, to_).
+///
+/// Every loop_ treats them the same way: the 1st one writes out the pending
+/// spaces, the others are just copied.  When tabs_, they also move the
+/// column, and the run can contain single spaces (each followed by an
+/// ordinary character), so a space at the beginning needs the next
+/// character too.
+template< AddDataLoop loop_, bool tabs_ >
+static inline void addDataRun( char*& dest, const char* from_, const char* to_,
+        int& column, int& spaces_to_write, bool& nonspace_appeared, int no_spaces )
+{
+    if ( from_ == to_ )
         return;
+
+    if ( tabs_ && *from_ == ' ' )
+        loop_( dest, *from_++, column, spaces_to_write, nonspace_appeared, no_spaces );
+
+    loop_( dest, *from_++, column, spaces_to_write, nonspace_appeared, no_spaces );
+
+    const size_t run = to_ - from_;
+    memcpy( dest, from_, run );
+    dest += run;
+    if ( tabs_ )
+        column += run;
+}
+
+/// Run the loop_ only for the special_ characters, and for the 1st character after them.
+///
+/// The special characters are found 32 bytes at a time by mask_.  When
+/// tabs_, a space is special only when another space or special character
+/// follows; the single spaces between the words are just copied.
+template< AddDataLoop loop_, bool tabs_, SpecialMask mask_ >
+static inline __attribute__(( always_inline )) void addDataBlocks( char*& dest, const char* data_, size_t len_, const char* special_,
+        int& column, int& spaces_to_write, bool& nonspace_appeared, int no_spaces )
+{
+    const char* it = data_;
+    const char* end = data_ + len_;
+
+    for ( ; end - it >= 32; )
+    {
+        const char* block_end = it + 32;
+        const char* block = it;
+
+        unsigned int mask = mask_( block, special_ );
+        if ( tabs_ )
+        {
+            // we do not see what follows the last one, consider it special
+            const unsigned int space = mask_( block, "    " );
+            mask |= space & ( ( ( space | mask ) >> 1 ) | 0x80000000u );
+        }
+
+        for ( ; mask != 0; mask &= mask - 1 )
+        {
+            const char* special = block + __builtin_ctz( mask );
+            addDataRun< loop_, tabs_ >( dest, it, special, column, spaces_to_write, nonspace_appeared, no_spaces );
+            loop_( dest, *special, column, spaces_to_write, nonspace_appeared, no_spaces );
+            it = special + 1;
+        }
+        addDataRun< loop_, tabs_ >( dest, it, block_end, column, spaces_to_write, nonspace_appeared, no_spaces );
+        it = block_end;
     }
 
-    // create big enough buffer
-    const int size = ( spaces < 2 )? 2*len_: spaces*len_;
-    char *tmp = new char[size];
+    for ( ; it < end; ++it )
+        loop_( dest, *it, column, spaces_to_write, nonspace_appeared, no_spaces );
+}
+
+#if defined( FILTER_SSE2 )
+/// addDataBlocks() compiled for AVX2, so that specialMaskAvx2() can be inlined.
+template< AddDataLoop loop_, bool tabs_ >
+__attribute__(( target( "avx2" ) ))
+static void addDataBlocksAvx2( char*& dest, const char* data_, size_t len_, const char* special_,
+        int& column, int& spaces_to_write, bool& nonspace_appeared, int no_spaces )
+{
+    addDataBlocks< loop_, tabs_, specialMaskAvx2 >( dest, data_, len_, special_, column, spaces_to_write, nonspace_appeared, no_spaces );
+}
+#endif
+
+/// Run the loop_ only for the special_ characters, using the best code for this CPU.
+///
+/// With FILTER_PER_BYTE, run it for every character instead (the reference
+/// for 'make bench-filter').
+template< AddDataLoop loop_, bool tabs_ >
+static void addDataRuns( char*& dest, const char* data_, size_t len_, const char* special_,
+        int& column, int& spaces_to_write, bool& nonspace_appeared, int no_spaces )
+{
+#if defined( FILTER_PER_BYTE )
+    for ( const char* it = data_; it < data_ + len_; ++it )
+        loop_( dest, *it, column, spaces_to_write, nonspace_appeared, no_spaces );
+#elif defined( FILTER_SSE2 )
+    if ( has_avx2 )
+        addDataBlocksAvx2< loop_, tabs_ >( dest, data_, len_, special_, column, spaces_to_write, nonspace_appeared, no_spaces );
+    else
+        addDataBlocks< loop_, tabs_, specialMaskSse2 >( dest, data_, len_, special_, column, spaces_to_write, nonspace_appeared, no_spaces );
+#else
+    addDataBlocks< loop_, tabs_, specialMaskScalar >( dest, data_, len_, special_, column, spaces_to_write, nonspace_appeared, no_spaces );
+#endif
+}
+
+size_t Filter::convert( const char* data_, size_t len_ )
+{
+    // big enough buffer, including the spaces pending from the previous data;
+    // never empty, so that &converted[0] is valid even for no data
+    const size_t size = ( ( spaces < 2 )? 2*len_: spaces*len_ ) + spaces_to_write + 1;
+    if ( converted.size() < size )
+        converted.resize( size );
+
+    char *tmp = &converted[0];
     char *dest = tmp;
 
     // convert the tabs to spaces (according to spaces)
     switch ( type )
     {
         case FILTER_OLD:
-            for ( const char* it = data_; it < data_ + len_; ++it )
-                addDataLoopOld( dest, *it, column, spaces_to_write, nonspace_appeared, spaces );
+            addDataRuns< addDataLoopOld, true >( dest, data_, len_, "\t\n\n\n", column, spaces_to_write, nonspace_appeared, spaces );
             break;
         case FILTER_COMBINED:
         case FILTER_COMBINED_HACK:
-            for ( const char* it = data_; it < data_ + len_; ++it )
-                addDataLoopCombined( dest, *it, column, spaces_to_write, nonspace_appeared, spaces );
+            addDataRuns< addDataLoopCombined, true >( dest, data_, len_, "\t\n\n\n", column, spaces_to_write, nonspace_appeared, spaces );
             break;
         case FILTER_COMBINED_DOS:
-            for ( const char* it = data_; it < data_ + len_; ++it )
-                addDataLoopCombinedDos( dest, *it, column, spaces_to_write, nonspace_appeared, spaces );
+            addDataRuns< addDataLoopCombinedDos, true >( dest, data_, len_, "\t\n\n\n", column, spaces_to_write, nonspace_appeared, spaces );
             break;
         case FILTER_TABS:
-            for ( const char* it = data_; it < data_ + len_; ++it )
-                addDataLoopTabs( dest, *it, column, spaces_to_write, nonspace_appeared, spaces );
+            addDataRuns< addDataLoopTabs, true >( dest, data_, len_, "\t\n\r\r", column, spaces_to_write, nonspace_appeared, spaces );
             break;
         case FILTER_DOS:
-            for ( const char* it = data_; it < data_ + len_; ++it )
-                addDataLoopDos( dest, *it, column, spaces_to_write, nonspace_appeared, spaces );
+            addDataRuns< addDataLoopDos, false >( dest, data_, len_, "\n\n\n\n", column, spaces_to_write, nonspace_appeared, spaces );
             break;
         case FILTER_UNX:
-            for ( const char* it = data_; it < data_ + len_; ++it )
-                addDataLoopUnx( dest, *it, column, spaces_to_write, nonspace_appeared, spaces );
+            addDataRuns< addDataLoopUnx, false >( dest, data_, len_, "\r\r\r\r", column, spaces_to_write, nonspace_appeared, spaces );
             break;
         case NO_FILTER:
-            // NO_FILTER already handled
+            // NO_FILTER handled by the callers
             break;
     }
 
-    data.append( tmp, dest - tmp );
+    return dest - tmp;
+}
 
-    delete[] tmp;
+void Filter::addData( const char* data_, size_t len_ )
+{
+    if ( type == NO_FILTER )
+    {
+        data.append( data_, len_ );
+        return;
+    }
+
+    // convert() may resize 'converted'
+    const size_t converted_len = convert( data_, len_ );
+    data.append( &converted[0], converted_len );
 }
 
 void Filter::addData( const string& data_ )
@@ -296,6 +457,13 @@ void Filter::addData( const string& data_ )
 }
 
 void Filter::write( std::ostream& out_ )
+{
+    string result;
+    finish( result );
+    writeFiltered( out_, result );
+}
+
+void Filter::finish( std::string& result_ )
 {
     if ( type == FILTER_COMBINED_HACK )
     {
@@ -304,20 +472,85 @@ void Filter::write( std::ostream& out_ )
             data += ' ';
     }
 
-    out_ << "data " << data.size() << endl
-         << data << endl;
+    result_.swap( data );
+    data.clear();
+}
+
+void Filter::writeFiltered( std::ostream& out_, const std::string& result_ )
+{
+    out_ << "data " << result_.size() << '\n';
+    out_.write( result_.data(), result_.size() );
+    out_ << '\n';
+}
+
+void Filter::count( const char* data_, size_t len_ )
+{
+    if ( type == NO_FILTER )
+        counted += len_;
+    else
+        counted += convert( data_, len_ );
+}
+
+void Filter::writeHeader( std::ostream& out_, long long length_ )
+{
+    if ( length_ < 0 )
+    {
+        length_ = counted;
+
+        // the trailing spaces that write() would add
+        if ( type == FILTER_COMBINED_HACK )
+            length_ += spaces_to_write;
+
+        // start from scratch for the 2nd pass
+        column = 0;
+        spaces_to_write = 0;
+        nonspace_appeared = false;
+    }
+
+    out_ << "data " << length_ << '\n';
+}
+
+void Filter::writeData( std::ostream& out_, const char* data_, size_t len_ )
+{
+    if ( type == NO_FILTER )
+        out_.write( data_, len_ );
+    else
+    {
+        // convert() may resize 'converted'
+        const size_t converted_len = convert( data_, len_ );
+        out_.write( &converted[0], converted_len );
+    }
+}
+
+void Filter::writeFooter( std::ostream& out_ )
+{
+    if ( type == FILTER_COMBINED_HACK )
+    {
+        // write out any spaces that we need
+        for ( int i = 0; i < spaces_to_write; ++i )
+            out_ << ' ';
+    }
+
+    out_ << '\n';
 }
 
 void Filter::addTabsToSpaces( int how_many_spaces_, FilterType type_, const std::string& files_regex_, FilePermission perm_ )
 {
     Tabs* tabs = new Tabs( how_many_spaces_, type_, perm_ );
 
-    int status = regcomp( &tabs->regex, files_regex_.c_str(), REG_EXTENDED | REG_NOSUB );
-    if ( status == 0 )
+    if ( tabs->regex.compile( files_regex_ ) )
+    {
         tabs_vector.push_back( tabs );
+        tabs_rules.add( &tabs->regex );
+    }
     else
     {
         Error::report( "Cannot create regex '" + files_regex_ + "' (for tabs_to_spaces_files)." );
         delete tabs;
     }
 }
+
+void Filter::report( std::ostream& out_ )
+{
+    tabs_rules.report( out_, "Filter rules" );
+}
@@ -10,6 +10,7 @@
 
 #include <string>
 #include <ostream>
+#include <vector>
 
 enum FilterType {
     NO_FILTER,           ///< No filtering at all
@@ -48,6 +49,15 @@ class Filter
 
     FilePermission perm;
 
+    /// Index of the rule (':set filter' line) that matched, -1 when none.
+    int rule;
+
+    /// Length of the output counted by count().
+    long long counted;
+
+    /// Buffer for convert().
+    std::vector< char > converted;
+
 public:
     Filter( const std::string& fname_ );
 
@@ -57,9 +67,44 @@ public:
 
     void write( std::ostream& out_ );
 
+    /// Instead of write(), take the result to result_, to write it with
+    /// writeFiltered() later (or in another thread).
+    void finish( std::string& result_ );
+
+    /// Write the result_ of finish().
+    static void writeFiltered( std::ostream& out_, const std::string& result_ );
+
+    /// Does the filter change the content (so that its length is not known in advance)?
+    bool changesContent() const { return type != NO_FILTER; }
+
+    /// Instead of addData() & write(), the content can be streamed to the
+    /// output in chunks, so that we do not need the entire file in memory:
+    ///
+    /// When changesContent(), pass it all to count() first, and then call
+    /// writeHeader() without length_.  Otherwise writeHeader() needs the
+    /// length_ of the content.  Then pass it all (again) to writeData(), and
+    /// finish with writeFooter().
+    void count( const char* data_, size_t len_ );
+
+    void writeHeader( std::ostream& out_, long long length_ = -1 );
+
+    void writeData( std::ostream& out_, const char* data_, size_t len_ );
+
+    void writeFooter( std::ostream& out_ );
+
     FilePermission getPermission() { return perm; }
 
+    /// Which rule matched - files with the same content and rule produce the same output.
+    int getRule() const { return rule; }
+
+    /// Write statistics about the matching of the rules.
+    static void report( std::ostream& out_ );
+
     static void addTabsToSpaces( int how_many_spaces_, FilterType type_, const std::string& files_regex_, FilePermission perm_ = PERMISSION_NO_CHANGE );
+
+private:
+    /// Filter data_ into 'converted', return the length of the result.
+    size_t convert( const char* data_, size_t len_ );
 };
 
 #endif // _FILTER_HXX_
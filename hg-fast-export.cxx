@@ -35,6 +35,9 @@
 using namespace std;
 using namespace boost;
 
+/// Every this many revisions, git fast-import writes out what it has.
+static const int checkpoint_revs = 10000;
+
 static int dump_blob( const python::object& filectx, const string &target_name )
 {
     string flags = python::extract< string >( filectx.attr( "flags" )() );
@@ -296,25 +299,47 @@ int crawl_revisions( const char *repos_path, const char* repos_config )
 
     // dump all the data
     for ( int rev = min_rev; rev < max_rev; rev++ )
+    {
         export_changeset( repo, repo[rev] );
 
+        if ( Repositories::failed() )
+        {
+            Error::report( "Stopping the export." );
+            break;
+        }
+
+        if ( ( rev - min_rev + 1 ) % checkpoint_revs == 0 )
+            Repositories::checkpoint();
+    }
+
     return 0;
 }
 
 int main(int argc, char *argv[])
 {
-    if (argc != 4) {
-        Error::report( string( "usage: " ) + argv[0] + " REPOS_PATH committers.txt reposlayout.txt\n" );
+    int arg = 1;
+    for ( ; arg < argc && strncmp( argv[arg], "--", 2 ) == 0; ++arg )
+    {
+        if ( strncmp( argv[arg], "--target=", 9 ) == 0 )
+            Repositories::setTarget( argv[arg] + 9 );
+        else
+            break;
+    }
+
+    if (argc - arg != 3) {
+        Error::report( string( "usage: " ) + argv[0] + " [--target=DIR] REPOS_PATH committers.txt reposlayout.txt\n\n"
+                "  --target=DIR  start git fast-import for each repository in DIR/<name>\n"
+                "                instead of writing <name>.dump" );
         return Error::returnValue();
     }
 
     // initialize Python
     Py_Initialize();
 
-    Committers::load( argv[2] );
+    Committers::load( argv[arg + 1] );
 
     // do the work
-    crawl_revisions( argv[1], argv[3] );
+    crawl_revisions( argv[arg], argv[arg + 2] );
 
     Py_Finalize();
 
@@ -22,24 +22,6 @@ EOF
 fi
 
 mkdir -p "$TARGET"
-rm *.dump
-
-for I in `sed -e 's/^[#:].*//' -e 's/^did-not-fit-anywhere.*//' -e 's/=.*//' "$LAYOUT" | grep -v '^$'` ; do
-    mkdir "$TARGET/$I"
-    mkfifo $I.dump
-    ( cd "$TARGET/$I" ; git init ; git fast-import < "$WD"/$I.dump ) &
-done
-
-./svn-fast-export "$SOURCE" "$COMMITTERS" "$LAYOUT"
-
-# wait until everything's finished
-while [ -n "`jobs`" ] ; do
-    echo jobs:
-    jobs
-    sleep 1
-done
-
-for I in `sed -e 's/^[#:].*//' -e 's/^did-not-fit-anywhere.*//' -e 's/=.*//' "$LAYOUT" | grep -v '^$'` ; do
-    ( cd "$TARGET/$I" ; echo `pwd` ; git branch | sed 's/^\*/ /' | grep 'tag-branches/' | xargs git branch -D )
-    rm $I.dump
-done
+
+# runs git fast-import for every repository itself
+./svn-fast-export --target="$TARGET" "$SOURCE" "$COMMITTERS" "$LAYOUT"
@@ -0,0 +1,843 @@
+/*
+ * Regular expressions matching the paths.
+ *
+ * Author: Jan Holesovsky <kendy@suse.cz>
+ * License: MIT <http://www.opensource.org/licenses/mit-license.php>
+ */
+
+#include "pathregex.hxx"
+
+#include <algorithm>
+#include <cctype>
+#include <climits>
+#include <cstring>
+
+using namespace std;
+
+/// Is the character part of a word (for \< and \>)?
+static inline bool isWordChar( unsigned char c_ )
+{
+    return isalnum( c_ ) || c_ == '_';
+}
+
+/// Parse the [...] bracket expression starting at pos_, move pos_ after it.
+static bool parseBracket( const string& regex_, size_t& pos_, bitset< 256 >& chars_ )
+{
+    size_t i = pos_ + 1;
+    bool negate = false;
+    if ( i < regex_.length() && regex_[i] == '^' )
+    {
+        negate = true;
+        ++i;
+    }
+
+    bool first = true;
+    for ( ; i < regex_.length() && ( first || regex_[i] != ']' ); ++i )
+    {
+        first = false;
+
+        // character classes, equivalence classes, collating symbols
+        if ( regex_[i] == '[' && i + 1 < regex_.length() &&
+             ( regex_[i + 1] == ':' || regex_[i + 1] == '=' || regex_[i + 1] == '.' ) )
+            return false;
+
+        unsigned char from = regex_[i];
+        unsigned char to = from;
+        if ( i + 2 < regex_.length() && regex_[i + 1] == '-' && regex_[i + 2] != ']' )
+        {
+            to = regex_[i + 2];
+            i += 2;
+        }
+
+        for ( unsigned int c = from; c <= to; ++c )
+            chars_.set( c );
+    }
+
+    if ( i >= regex_.length() )
+        return false;
+
+    if ( negate )
+        chars_.flip();
+
+    pos_ = i + 1;
+
+    return true;
+}
+
+/// Parse one alternative that contains no groups or alternations.
+static bool parseAlternative( const string& regex_, PathRegexAlternative& alternative_ )
+{
+    size_t i = 0;
+    if ( i < regex_.length() && regex_[i] == '^' )
+    {
+        alternative_.anchored = true;
+        ++i;
+    }
+
+    while ( i < regex_.length() )
+    {
+        // trailing .* is the same as nothing
+        if ( regex_.compare( i, string::npos, ".*" ) == 0 )
+            break;
+
+        bitset< 256 > chars;
+        switch ( regex_[i] )
+        {
+            case '\\':
+                if ( i + 1 >= regex_.length() )
+                    return false;
+                // \> only at the end, elsewhere it is no literal '>'
+                if ( regex_[i + 1] == '>' )
+                {
+                    if ( i + 2 != regex_.length() )
+                        return false;
+                    alternative_.end = PathRegexAlternative::END_WORD;
+                    return true;
+                }
+                // \<, \w, \b, back references, ...
+                if ( regex_[i + 1] == '<' || isalnum( static_cast< unsigned char >( regex_[i + 1] ) ) )
+                    return false;
+                chars.set( static_cast< unsigned char >( regex_[i + 1] ) );
+                i += 2;
+                break;
+            case '$':
+                if ( i + 1 != regex_.length() )
+                    return false;
+                alternative_.end = PathRegexAlternative::END_LINE;
+                return true;
+            case '.':
+                chars.set();
+                ++i;
+                break;
+            case '[':
+                if ( !parseBracket( regex_, i, chars ) )
+                    return false;
+                break;
+            case '^': case '(': case ')': case '|':
+            case '*': case '+': case '?': case '{': case '}':
+                return false;
+            default:
+                chars.set( static_cast< unsigned char >( regex_[i] ) );
+                ++i;
+                break;
+        }
+
+        // repetitions
+        if ( i < regex_.length() &&
+             ( regex_[i] == '*' || regex_[i] == '+' || regex_[i] == '?' || regex_[i] == '{' ) )
+            return false;
+
+        alternative_.chars.push_back( chars );
+    }
+
+    return true;
+}
+
+/// Split regex_ at the top-level |.
+static bool splitAlternatives( const string& regex_, vector< string >& alternatives_ )
+{
+    size_t start = 0;
+    for ( size_t i = 0; i < regex_.length(); ++i )
+    {
+        if ( regex_[i] == '\\' )
+            ++i;
+        else if ( regex_[i] == '[' )
+        {
+            bitset< 256 > dummy;
+            if ( !parseBracket( regex_, i, dummy ) )
+                return false;
+            --i;
+        }
+        else if ( regex_[i] == '(' || regex_[i] == ')' )
+            return false;
+        else if ( regex_[i] == '|' )
+        {
+            alternatives_.push_back( regex_.substr( start, i - start ) );
+            start = i + 1;
+        }
+    }
+    alternatives_.push_back( regex_.substr( start ) );
+
+    return true;
+}
+
+/// Find the top-level ( or ) at or after pos_; string::npos when there is none.
+static size_t findParenthesis( const string& regex_, size_t pos_ )
+{
+    for ( size_t i = pos_; i < regex_.length(); ++i )
+    {
+        if ( regex_[i] == '\\' )
+            ++i;
+        else if ( regex_[i] == '[' )
+        {
+            bitset< 256 > dummy;
+            if ( !parseBracket( regex_, i, dummy ) )
+                return string::npos;
+            --i;
+        }
+        else if ( regex_[i] == '(' || regex_[i] == ')' )
+            return i;
+    }
+    return string::npos;
+}
+
+/// Understand regexes like ^(foo|bar)\>, (^foo|bar$) or \.(c|cxx|h)$.
+static bool analyse( const string& regex_, vector< PathRegexAlternative >& alternatives_ )
+{
+    string prefix, suffix, inner( regex_ );
+
+    // one group with the alternatives, the text around it belongs to each
+    // of them: \.(c|h)$ is the same as \.c$|\.h$
+    size_t open = findParenthesis( regex_, 0 );
+    if ( open != string::npos )
+    {
+        size_t close = findParenthesis( regex_, open + 1 );
+        if ( close == string::npos || regex_[close] != ')' )
+            return false;
+
+        prefix = regex_.substr( 0, open );
+        suffix = regex_.substr( close + 1 );
+        inner = regex_.substr( open + 1, close - open - 1 );
+
+        // a repeated group does not split like that; more groups or |
+        // outside of it are refused by parseAlternative()
+        if ( !suffix.empty() && ( suffix[0] == '*' || suffix[0] == '+' || suffix[0] == '?' || suffix[0] == '{' ) )
+            return false;
+    }
+
+    vector< string > split;
+    if ( !splitAlternatives( inner, split ) )
+        return false;
+
+    for ( vector< string >::const_iterator it = split.begin(); it != split.end(); ++it )
+    {
+        // anchors both inside and outside
+        if ( ( !prefix.empty() && it->compare( 0, 1, "^" ) == 0 ) ||
+             ( !suffix.empty() && ( ( it->length() > 0 && (*it)[it->length() - 1] == '$' ) ||
+                                    ( it->length() > 1 && it->compare( it->length() - 2, 2, "\\>" ) == 0 ) ) ) )
+            return false;
+
+        PathRegexAlternative alternative;
+        if ( !parseAlternative( prefix + *it + suffix, alternative ) )
+            return false;
+
+        alternatives_.push_back( alternative );
+    }
+
+    return true;
+}
+
+/// How does the alternative match the paths starting with prefix_ (the directory + '/').
+static PathRegex::DirectoryMatch matchesDirectory( const PathRegexAlternative& alternative_, const string& prefix_ )
+{
+    const size_t len = alternative_.chars.size();
+
+    if ( !alternative_.anchored )
+    {
+        // matches everything
+        if ( len == 0 && alternative_.end == PathRegexAlternative::END_ANY )
+            return PathRegex::MATCHES_ALL;
+
+        // can match anywhere
+        return PathRegex::MATCHES_SOME;
+    }
+
+    for ( size_t i = 0; i < len && i < prefix_.length(); ++i )
+    {
+        if ( !alternative_.chars[i].test( static_cast< unsigned char >( prefix_[i] ) ) )
+            return PathRegex::MATCHES_NONE;
+    }
+
+    // depends on the rest of the path
+    if ( len > prefix_.length() )
+        return PathRegex::MATCHES_SOME;
+
+    switch ( alternative_.end )
+    {
+        case PathRegexAlternative::END_ANY:
+            return PathRegex::MATCHES_ALL;
+        case PathRegexAlternative::END_WORD:
+            // the character after the prefix is the beginning of a file name
+            if ( len > 0 && len < prefix_.length() &&
+                 isWordChar( prefix_[len - 1] ) && !isWordChar( prefix_[len] ) )
+                return PathRegex::MATCHES_ALL;
+            return PathRegex::MATCHES_NONE;
+        case PathRegexAlternative::END_LINE:
+            // the paths are always longer than the prefix
+            return PathRegex::MATCHES_NONE;
+    }
+
+    return PathRegex::MATCHES_SOME;
+}
+
+PathRegex::PathRegex()
+    : compiled( false ),
+      analysed( false )
+{
+}
+
+PathRegex::~PathRegex()
+{
+    if ( compiled )
+        regfree( &regex );
+}
+
+bool PathRegex::compile( const string& regex_ )
+{
+    if ( compiled )
+        regfree( &regex );
+    compiled = false;
+
+    alternatives.clear();
+    paths.clear();
+    suffixes.clear();
+
+    // the lists of paths or suffixes can be huge, and regcomp() is slow for them
+    const bool understood = analyse( regex_, alternatives );
+    if ( understood && extractLiterals() )
+    {
+        alternatives.clear();
+        analysed = false;
+        return true;
+    }
+
+    compiled = ( regcomp( &regex, regex_.c_str(), REG_EXTENDED | REG_NOSUB ) == 0 );
+
+    analysed = compiled && understood;
+    if ( !analysed )
+        alternatives.clear();
+
+    return compiled;
+}
+
+/// The first (usually the only) character in the set.
+static inline char firstChar( const bitset< 256 >& chars_ )
+{
+    for ( int c = 0; c < 256; ++c )
+    {
+        if ( chars_.test( c ) )
+            return static_cast< char >( c );
+    }
+    return 0;
+}
+
+bool PathRegex::extractLiterals()
+{
+    bool all_paths = true;
+    bool all_suffixes = true;
+
+    for ( vector< PathRegexAlternative >::const_iterator it = alternatives.begin(); it != alternatives.end(); ++it )
+    {
+        if ( it->chars.empty() || it->end != PathRegexAlternative::END_LINE )
+            return false;
+
+        for ( vector< bitset< 256 > >::const_iterator chars = it->chars.begin(); chars != it->chars.end(); ++chars )
+        {
+            // '.' is still fine in the file names
+            if ( chars->count() != 1 && ( !it->anchored || !chars->all() ) )
+                return false;
+            if ( chars->count() != 1 )
+                all_suffixes = false;
+        }
+
+        if ( it->anchored )
+            all_suffixes = false;
+        else
+            all_paths = false;
+    }
+
+    if ( all_suffixes )
+    {
+        for ( vector< PathRegexAlternative >::const_iterator it = alternatives.begin(); it != alternatives.end(); ++it )
+        {
+            string suffix;
+            for ( vector< bitset< 256 > >::const_iterator chars = it->chars.begin(); chars != it->chars.end(); ++chars )
+                suffix += firstChar( *chars );
+
+            suffixes[suffix.length()].insert( suffix );
+        }
+        return true;
+    }
+
+    if ( !all_paths )
+        return false;
+
+    for ( vector< PathRegexAlternative >::const_iterator it = alternatives.begin(); it != alternatives.end(); ++it )
+    {
+        string path;
+        size_t slash = string::npos;
+        for ( vector< bitset< 256 > >::const_iterator chars = it->chars.begin(); chars != it->chars.end(); ++chars )
+        {
+            if ( chars->all() )
+                path += '\0';
+            else
+            {
+                path += firstChar( *chars );
+                if ( path[path.length() - 1] == '/' )
+                    slash = path.length() - 1;
+            }
+        }
+
+        // the directory must be literal
+        if ( slash != string::npos && path.find( '\0' ) < slash )
+        {
+            paths.clear();
+            return false;
+        }
+
+        if ( slash == string::npos )
+            paths[string()].push_back( path );
+        else
+            paths[path.substr( 0, slash + 1 )].push_back( path.substr( slash + 1 ) );
+    }
+
+    return true;
+}
+
+/// Does name_ (with \0 matching any character) match text_ of the length len_?
+static inline bool matchesName( const string& name_, const char* text_, size_t len_ )
+{
+    for ( size_t i = 0; i < len_; ++i )
+    {
+        if ( name_[i] != text_[i] && name_[i] != '\0' )
+            return false;
+    }
+    return true;
+}
+
+bool PathRegex::matchesPaths( const string& fname_ ) const
+{
+    // the '.' in the file name can match a '/' too, so try all the directories
+    // where the file can be; mostly there is just one
+    size_t slash = string::npos;
+    do
+    {
+        const size_t start = ( slash == string::npos )? 0: slash + 1;
+
+        map< string, vector< string > >::const_iterator it = paths.find( fname_.substr( 0, start ) );
+        if ( it != paths.end() )
+        {
+            const size_t len = fname_.length() - start;
+            for ( vector< string >::const_iterator name = it->second.begin(); name != it->second.end(); ++name )
+            {
+                if ( name->length() == len && matchesName( *name, fname_.data() + start, len ) )
+                    return true;
+            }
+        }
+
+        slash = fname_.find( '/', start );
+    } while ( slash != string::npos );
+
+    return false;
+}
+
+bool PathRegex::matchesPathsDirectory( const string& dir_ ) const
+{
+    const string prefix( dir_ + '/' );
+
+    // the directory itself, or its subdirectories
+    map< string, vector< string > >::const_iterator it = paths.lower_bound( prefix );
+    if ( it != paths.end() && it->first.compare( 0, prefix.length(), prefix ) == 0 )
+        return true;
+
+    // a name in a parent directory, where a '.' matches the '/'
+    size_t slash = string::npos;
+    do
+    {
+        const size_t start = ( slash == string::npos )? 0: slash + 1;
+
+        it = paths.find( prefix.substr( 0, start ) );
+        if ( it != paths.end() )
+        {
+            const size_t len = prefix.length() - start;
+            for ( vector< string >::const_iterator name = it->second.begin(); name != it->second.end(); ++name )
+            {
+                if ( name->length() > len && matchesName( *name, prefix.data() + start, len ) )
+                    return true;
+            }
+        }
+
+        slash = prefix.find( '/', start );
+    } while ( slash != string::npos && slash + 1 < prefix.length() );
+
+    return false;
+}
+
+bool PathRegex::matches( const string& fname_ ) const
+{
+    if ( !paths.empty() )
+        return matchesPaths( fname_ );
+
+    if ( !suffixes.empty() )
+    {
+        for ( map< size_t, set< string > >::const_iterator it = suffixes.begin(); it != suffixes.end() && it->first <= fname_.length(); ++it )
+        {
+            if ( it->second.find( fname_.substr( fname_.length() - it->first ) ) != it->second.end() )
+                return true;
+        }
+        return false;
+    }
+
+    return compiled && regexec( &regex, fname_.c_str(), 0, NULL, 0 ) == 0;
+}
+
+PathRegex::DirectoryMatch PathRegex::matchesDirectory( const string& dir_ ) const
+{
+    if ( dir_.empty() )
+        return MATCHES_SOME;
+
+    if ( !paths.empty() )
+        return matchesPathsDirectory( dir_ )? MATCHES_SOME: MATCHES_NONE;
+
+    if ( !analysed )
+        return MATCHES_SOME;
+
+    const string prefix( dir_ + '/' );
+
+    DirectoryMatch result = MATCHES_NONE;
+    for ( vector< PathRegexAlternative >::const_iterator it = alternatives.begin(); it != alternatives.end(); ++it )
+    {
+        DirectoryMatch match = ::matchesDirectory( *it, prefix );
+        if ( match == MATCHES_ALL )
+            return MATCHES_ALL;
+        else if ( match == MATCHES_SOME )
+            result = MATCHES_SOME;
+    }
+
+    return result;
+}
+
+PathRegexAutomaton::PathRegexAutomaton()
+    : always( INT_MAX ),
+      classes( 1 )
+{
+    memset( byte_class, 0, sizeof( byte_class ) );
+    reset();
+}
+
+bool PathRegexAutomaton::add( const PathRegex* regex_, int index_ )
+{
+    if ( !regex_->isAnalysed() )
+        return false;
+
+    const vector< PathRegexAlternative >& alts = regex_->getAlternatives();
+
+    // \> alone can match anywhere, do not bother
+    for ( vector< PathRegexAlternative >::const_iterator it = alts.begin(); it != alts.end(); ++it )
+    {
+        if ( !it->anchored && it->chars.empty() && it->end == PathRegexAlternative::END_WORD )
+            return false;
+    }
+
+    for ( vector< PathRegexAlternative >::const_iterator it = alts.begin(); it != alts.end(); ++it )
+    {
+        if ( it->chars.empty() )
+        {
+            // ^\> never matches, ^$ is handled as any other alternative
+            if ( it->anchored && it->end == PathRegexAlternative::END_WORD )
+                continue;
+
+            // .*, ^.* and $ match everything
+            if ( !it->anchored || it->end == PathRegexAlternative::END_ANY )
+            {
+                always = min( always, index_ );
+                continue;
+            }
+        }
+
+        Alternative alternative;
+        alternative.regex = index_;
+        alternative.alternative = &(*it);
+        alternative.first_id = nfa_alternative.size();
+
+        nfa_alternative.insert( nfa_alternative.end(), it->chars.size() + 1, alternatives.size() );
+        alternatives.push_back( alternative );
+
+        // refine the byte classes
+        for ( vector< bitset< 256 > >::const_iterator chars = it->chars.begin(); chars != it->chars.end(); ++chars )
+        {
+            map< pair< unsigned char, bool >, unsigned char > refined;
+            for ( int c = 0; c < 256; ++c )
+            {
+                pair< unsigned char, bool > key( byte_class[c], chars->test( c ) );
+                map< pair< unsigned char, bool >, unsigned char >::const_iterator found = refined.find( key );
+                if ( found == refined.end() )
+                {
+                    unsigned char id = refined.size();
+                    refined[key] = id;
+                    byte_class[c] = id;
+                }
+                else
+                    byte_class[c] = found->second;
+            }
+        }
+    }
+
+    // the word characters have to be distinguished too
+    map< pair< unsigned char, bool >, unsigned char > refined;
+    for ( int c = 0; c < 256; ++c )
+    {
+        pair< unsigned char, bool > key( byte_class[c], isWordChar( c ) );
+        map< pair< unsigned char, bool >, unsigned char >::const_iterator found = refined.find( key );
+        if ( found == refined.end() )
+        {
+            unsigned char id = refined.size();
+            refined[key] = id;
+            byte_class[c] = id;
+        }
+        else
+            byte_class[c] = found->second;
+    }
+    classes = refined.size();
+
+    reset();
+
+    return true;
+}
+
+void PathRegexAutomaton::reset()
+{
+    states.clear();
+    state_ids.clear();
+
+    // the initial state
+    vector< unsigned int > nfa;
+    for ( vector< Alternative >::const_iterator it = alternatives.begin(); it != alternatives.end(); ++it )
+        nfa.push_back( it->first_id );
+
+    state( nfa, always );
+}
+
+int PathRegexAutomaton::state( vector< unsigned int >& nfa_, int best_ )
+{
+    sort( nfa_.begin(), nfa_.end() );
+    nfa_.erase( unique( nfa_.begin(), nfa_.end() ), nfa_.end() );
+
+    // nothing after the best can improve the result
+    int best_at_end = best_;
+    vector< unsigned int > nfa;
+    for ( vector< unsigned int >::const_iterator it = nfa_.begin(); it != nfa_.end(); ++it )
+    {
+        const Alternative& alternative = alternatives[nfa_alternative[*it]];
+        if ( alternative.regex >= best_ )
+            continue;
+
+        nfa.push_back( *it );
+
+        if ( *it - alternative.first_id == alternative.alternative->chars.size() )
+            best_at_end = min( best_at_end, alternative.regex );
+    }
+
+    StateKey key( nfa, best_ );
+    map< StateKey, int >::const_iterator it = state_ids.find( key );
+    if ( it != state_ids.end() )
+        return it->second;
+
+    State new_state;
+    new_state.nfa.swap( nfa );
+    new_state.best = best_;
+    new_state.best_at_end = best_at_end;
+    new_state.next.resize( classes, -1 );
+
+    int id = states.size();
+    states.push_back( new_state );
+    state_ids[key] = id;
+
+    return id;
+}
+
+int PathRegexAutomaton::transition( int state_, unsigned char c_ )
+{
+    int& next = states[state_].next[byte_class[c_]];
+    if ( next >= 0 )
+        return next;
+
+    const bool word = isWordChar( c_ );
+    int best = states[state_].best;
+    vector< unsigned int > nfa;
+
+    const vector< unsigned int >& current = states[state_].nfa;
+    for ( vector< unsigned int >::const_iterator it = current.begin(); it != current.end(); ++it )
+    {
+        const Alternative& alternative = alternatives[nfa_alternative[*it]];
+        const PathRegexAlternative& alt = *alternative.alternative;
+        const size_t pos = *it - alternative.first_id;
+
+        if ( pos == alt.chars.size() )
+        {
+            // waiting for the end of the word (or of the path)
+            if ( alt.end == PathRegexAlternative::END_WORD && !word )
+                best = min( best, alternative.regex );
+        }
+        else if ( alt.chars[pos].test( c_ ) )
+        {
+            if ( pos + 1 < alt.chars.size() )
+                nfa.push_back( *it + 1 );
+            else if ( alt.end == PathRegexAlternative::END_ANY )
+                best = min( best, alternative.regex );
+            else if ( alt.end == PathRegexAlternative::END_LINE || word )
+                nfa.push_back( *it + 1 );
+        }
+    }
+
+    // the unanchored alternatives can start anywhere
+    for ( vector< Alternative >::const_iterator it = alternatives.begin(); it != alternatives.end(); ++it )
+    {
+        if ( !it->alternative->anchored )
+            nfa.push_back( it->first_id );
+    }
+
+    int result = state( nfa, best );
+
+    // 'states' might have been reallocated
+    states[state_].next[byte_class[c_]] = result;
+
+    return result;
+}
+
+int PathRegexAutomaton::firstMatch( const string& fname_ )
+{
+    if ( states.size() > max_states )
+        reset();
+
+    int current = 0;
+    for ( string::const_iterator it = fname_.begin(); it != fname_.end(); ++it )
+    {
+        current = transition( current, *it );
+
+        // nothing can change any more
+        if ( states[current].nfa.empty() )
+            break;
+    }
+
+    int best = states[current].best_at_end;
+
+    return ( best == INT_MAX )? -1: best;
+}
+
+PathRegexList::PathRegexList()
+    : lookups( 0 ),
+      single_matches( 0 ),
+      automaton_runs( 0 ),
+      by_directory( 0 )
+{
+}
+
+void PathRegexList::add( const PathRegex* regex_ )
+{
+    one_by_one.push_back( !automaton.add( regex_, regexes.size() ) );
+    regexes.push_back( regex_ );
+    directories.clear();
+}
+
+const PathRegexList::Candidates& PathRegexList::candidates( const string& dir_ )
+{
+    DirectoryCandidates::iterator it = directories.find( dir_ );
+    if ( it != directories.end() )
+        return it->second;
+
+    Candidates& result = directories[dir_];
+    for ( size_t i = 0; i < regexes.size(); ++i )
+    {
+        PathRegex::DirectoryMatch match = regexes[i]->matchesDirectory( dir_ );
+        if ( match == PathRegex::MATCHES_ALL )
+        {
+            result.all = i;
+            break;
+        }
+        else if ( match == PathRegex::MATCHES_SOME )
+            result.maybe.push_back( i );
+    }
+
+    return result;
+}
+
+int PathRegexList::firstMatch( const string& fname_ )
+{
+    ++lookups;
+
+    const Candidates* cand = NULL;
+
+    // nothing to cache for the toplevel files
+    size_t slash = fname_.rfind( '/' );
+    if ( slash != string::npos && slash != 0 )
+    {
+        cand = &candidates( fname_.substr( 0, slash ) );
+        if ( cand->maybe.empty() )
+        {
+            ++by_directory;
+            return cand->all;
+        }
+    }
+
+    if ( cand == NULL )
+    {
+        // all that the automaton understands in one pass
+        ++automaton_runs;
+        int found = automaton.firstMatch( fname_ );
+
+        // the rest one by one, as long as they are before what we found
+        for ( size_t i = 0; i < regexes.size() && ( found < 0 || static_cast< int >( i ) < found ); ++i )
+        {
+            if ( !one_by_one[i] )
+                continue;
+
+            ++single_matches;
+            if ( regexes[i]->matches( fname_ ) )
+                return i;
+        }
+
+        return found;
+    }
+
+    // only the candidates for the directory
+    int found = cand->all;
+    for ( vector< int >::const_iterator it = cand->maybe.begin(); it != cand->maybe.end(); ++it )
+    {
+        if ( !one_by_one[*it] )
+        {
+            ++automaton_runs;
+            int match = automaton.firstMatch( fname_ );
+            if ( match >= 0 && ( found < 0 || match < found ) )
+                found = match;
+            break;
+        }
+    }
+
+    for ( vector< int >::const_iterator it = cand->maybe.begin(); it != cand->maybe.end() && ( found < 0 || *it < found ); ++it )
+    {
+        if ( !one_by_one[*it] )
+            continue;
+
+        ++single_matches;
+        if ( regexes[*it]->matches( fname_ ) )
+            return *it;
+    }
+
+    return found;
+}
+
+int PathRegexList::firstMatchDirectory( const string& dir_ )
+{
+    if ( dir_.empty() )
+        return -1;
+
+    const Candidates& cand = candidates( dir_ );
+    if ( !cand.maybe.empty() )
+        return -1;
+
+    return ( cand.all >= 0 )? cand.all: -2;
+}
+
+void PathRegexList::report( ostream& out_, const string& what_ ) const
+{
+    if ( lookups == 0 )
+        return;
+
+    out_ << what_ << ": " << lookups << " paths, "
+         << directories.size() << " directories cached, "
+         << ( 100.0 * by_directory / lookups ) << "% decided by the directory, "
+         << automaton_runs << " automaton runs, "
+         << ( static_cast< double >( single_matches ) / lookups ) << " single matches per path (instead of up to "
+         << regexes.size() << ")" << endl;
+}
@@ -0,0 +1,237 @@
+/*
+ * Regular expressions matching the paths.
+ *
+ * Author: Jan Holesovsky <kendy@suse.cz>
+ * License: MIT <http://www.opensource.org/licenses/mit-license.php>
+ */
+
+#ifndef _PATHREGEX_HXX_
+#define _PATHREGEX_HXX_
+
+#include <bitset>
+#include <map>
+#include <ostream>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <regex.h>
+
+/// One alternative of a simple regex, like ^foo\> or ^ba[rz]/.
+struct PathRegexAlternative
+{
+    /// Starts with ^.
+    bool anchored;
+
+    /// What each of the characters can be.
+    std::vector< std::bitset< 256 > > chars;
+
+    /// What follows the characters.
+    enum End {
+        END_ANY,  ///< Anything
+        END_WORD, ///< \>
+        END_LINE, ///< $
+    } end;
+
+    PathRegexAlternative() : anchored( false ), chars(), end( END_ANY ) {}
+};
+
+class PathRegex
+{
+    regex_t regex;
+
+    /// Did regcomp() succeed?
+    bool compiled;
+
+    /// Do we understand the regex (ie. are the alternatives valid)?
+    bool analysed;
+
+    /// The alternatives of the regex.
+    std::vector< PathRegexAlternative > alternatives;
+
+    /// Lists of paths, like ^(foo/bar.c|baz.h)$, need no regcomp()/regexec().
+    ///
+    /// Directory (with the trailing '/') -> names of the files in it; \0 in
+    /// the name stands for '.' (any character).  The directories have to be
+    /// literal.
+    std::map< std::string, std::vector< std::string > > paths;
+
+    /// Lists of suffixes, like \.(c|cxx|h)$, need no regcomp()/regexec() either.
+    ///
+    /// Length -> suffixes of that length.
+    std::map< size_t, std::set< std::string > > suffixes;
+
+public:
+    /// How does the regex match files in a directory.
+    enum DirectoryMatch {
+        MATCHES_NONE, ///< Matches none of the files
+        MATCHES_ALL,  ///< Matches all of the files
+        MATCHES_SOME, ///< Matches some of them, or we cannot tell
+    };
+
+    PathRegex();
+
+    ~PathRegex();
+
+    /// Compile the regex (REG_EXTENDED); returns false when it is not valid.
+    bool compile( const std::string& regex_ );
+
+    /// Does the fname match?
+    bool matches( const std::string& fname_ ) const;
+
+    /// Does the regex match the files in the directory dir_ (and its subdirectories)?
+    DirectoryMatch matchesDirectory( const std::string& dir_ ) const;
+
+    /// Do we understand the regex?
+    ///
+    /// False for the lists of paths or suffixes, they are matched by a lookup.
+    bool isAnalysed() const { return analysed; }
+
+    /// The alternatives, valid only when isAnalysed().
+    const std::vector< PathRegexAlternative >& getAlternatives() const { return alternatives; }
+
+private:
+    /// Turn the alternatives into 'paths' or 'suffixes' if possible.
+    bool extractLiterals();
+
+    /// Does fname_ match one of the 'paths'?
+    bool matchesPaths( const std::string& fname_ ) const;
+
+    /// Can one of the 'paths' match a file in dir_ (or its subdirectories)?
+    bool matchesPathsDirectory( const std::string& dir_ ) const;
+
+    PathRegex( const PathRegex& );
+    PathRegex& operator=( const PathRegex& );
+};
+
+/// DFA matching many (analysed) regexes at once, in one pass over the path.
+///
+/// The states are created lazily, only for the paths that we really see.
+class PathRegexAutomaton
+{
+    /// One alternative of one of the regexes.
+    struct Alternative
+    {
+        /// Index of the regex.
+        int regex;
+
+        const PathRegexAlternative* alternative;
+
+        /// Id of the NFA state for the position 0 in this alternative;
+        /// position N has the id first_id + N.
+        unsigned int first_id;
+    };
+
+    /// State of the DFA = set of the NFA states.
+    struct State
+    {
+        /// The NFA states (sorted).
+        std::vector< unsigned int > nfa;
+
+        /// The 1st regex that already matched.
+        int best;
+
+        /// The 1st regex that matches if the path ends here.
+        int best_at_end;
+
+        /// Transitions (by the byte class), -1 when not computed yet.
+        std::vector< int > next;
+    };
+
+    typedef std::pair< std::vector< unsigned int >, int > StateKey;
+
+    std::vector< Alternative > alternatives;
+
+    /// NFA state id -> index to alternatives.
+    std::vector< unsigned int > nfa_alternative;
+
+    /// Regex that matches everything.
+    int always;
+
+    /// Bytes that behave the same way share the class.
+    unsigned char byte_class[256];
+    unsigned int classes;
+
+    std::vector< State > states;
+    std::map< StateKey, int > state_ids;
+
+    /// Number of states when we start from scratch.
+    static const size_t max_states = 10000;
+
+public:
+    PathRegexAutomaton();
+
+    /// Add the regex (with index regex_); returns false if we cannot handle it.
+    bool add( const PathRegex* regex_, int index_ );
+
+    /// Index of the 1st of the added regexes that matches, or -1.
+    int firstMatch( const std::string& fname_ );
+
+private:
+    void reset();
+
+    int state( std::vector< unsigned int >& nfa_, int best_ );
+
+    int transition( int state_, unsigned char c_ );
+};
+
+/// Ordered list of regexes where the 1st match wins.
+///
+/// Remembers for every directory which regexes can match the files there at
+/// all, so that most of the paths need no matching at all; the rest is
+/// matched in one pass by PathRegexAutomaton (and one by one for the regexes
+/// it does not understand).
+class PathRegexList
+{
+    /// Which regexes to try for the files in a directory.
+    struct Candidates
+    {
+        /// These might match (we have to try them).
+        std::vector< int > maybe;
+
+        /// This matches all the files (if none of 'maybe' did), or -1.
+        int all;
+
+        Candidates() : maybe(), all( -1 ) {}
+    };
+
+    typedef std::map< std::string, Candidates > DirectoryCandidates;
+
+    std::vector< const PathRegex* > regexes;
+
+    DirectoryCandidates directories;
+
+    /// Matches all the regexes that it can handle at once.
+    PathRegexAutomaton automaton;
+
+    /// Regexes that we have to match one by one (regexec(), or the lookup of paths/suffixes).
+    std::vector< bool > one_by_one;
+
+    /// Statistics.
+    unsigned long lookups;
+    unsigned long single_matches;
+    unsigned long automaton_runs;
+    unsigned long by_directory;
+
+public:
+    PathRegexList();
+
+    /// Add the regex to the end of the list.
+    void add( const PathRegex* regex_ );
+
+    /// Index of the 1st regex that matches fname_, or -1.
+    int firstMatch( const std::string& fname_ );
+
+    /// Index of the regex that matches all the files in dir_ (when all
+    /// regexes before it match none of them), -1 when we cannot tell, and
+    /// -2 when none of the regexes matches.
+    int firstMatchDirectory( const std::string& dir_ );
+
+    /// Write statistics about how much the per-directory cache helped.
+    void report( std::ostream& out_, const std::string& what_ ) const;
+
+private:
+    const Candidates& candidates( const std::string& dir_ );
+};
+
+#endif // _PATHREGEX_HXX_
@@ -0,0 +1,185 @@
+/*
+ * The branches and the copies between them, found before reading any content.
+ *
+ * Author: Jan Holesovsky <kendy@suse.cz>
+ * License: MIT <http://www.opensource.org/licenses/mit-license.php>
+ */
+
+#include "plan.hxx"
+#include "error.hxx"
+
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <utility>
+
+using namespace std;
+
+/// Identifies the file (and the version of its format).
+static const char plan_magic[] = "svn-fast-export plan 3";
+
+/// FNV-1a of the content of fname_, as text; empty when it cannot be read.
+static string checksum( const char* fname_ )
+{
+    ifstream input( fname_, ios_base::in | ios_base::binary );
+    if ( !input )
+        return string();
+
+    unsigned long long hash = 14695981039346656037ULL;
+    char buffer[65536];
+    while ( input.read( buffer, sizeof( buffer ) ) || input.gcount() > 0 )
+    {
+        for ( streamsize i = 0; i < input.gcount(); ++i )
+        {
+            hash ^= static_cast< unsigned char >( buffer[i] );
+            hash *= 1099511628211ULL;
+        }
+    }
+
+    char text[20];
+    snprintf( text, sizeof( text ), "%016llx", hash );
+
+    return text;
+}
+
+Plan::Plan( const string& uuid_, const char* layout_fname_, unsigned int first_ )
+    : uuid( uuid_ ),
+      layout( checksum( layout_fname_ ) ),
+      first( first_ ),
+      planned( 0 ),
+      branches(),
+      copies(),
+      dead()
+{
+}
+
+bool Plan::load( const string& fname_ )
+{
+    ifstream input( fname_.c_str(), ifstream::in );
+    if ( !input )
+        return false;
+
+    string line, saved_uuid, saved_layout;
+    unsigned int saved_first = 0, saved_last = 0;
+    map< string, bool > saved_branches;
+    set< pair< string, string > > saved_copies;
+    bool valid = true;
+
+    getline( input, line );
+    if ( line != plan_magic )
+        valid = false;
+
+    // 'key value...', the branch names are separated by tabs (can contain spaces)
+    while ( valid && getline( input, line ) )
+    {
+        const size_t space = line.find_first_of( " \t" );
+        const string key( line.substr( 0, space ) );
+        const string value( space == string::npos? string(): line.substr( space + 1 ) );
+        istringstream fields( value );
+
+        if ( key == "uuid" )
+            fields >> saved_uuid;
+        else if ( key == "layout" )
+            fields >> saved_layout;
+        else if ( key == "revisions" )
+            valid = !( fields >> saved_first >> saved_last ).fail();
+        else if ( key == "branch" )
+        {
+            const size_t tab = value.find( '\t' );
+            valid = ( tab != string::npos );
+            if ( valid )
+                saved_branches[value.substr( tab + 1 )] = ( value.substr( 0, tab ) == "1" );
+        }
+        else if ( key == "copy" )
+        {
+            const size_t tab = value.find( '\t' );
+            valid = ( tab != string::npos );
+            if ( valid )
+                saved_copies.insert( make_pair( value.substr( 0, tab ), value.substr( tab + 1 ) ) );
+        }
+    }
+
+    if ( !valid )
+    {
+        Error::report( "'" + fname_ + "' is not a valid plan." );
+        return false;
+    }
+
+    if ( saved_uuid != uuid || saved_layout != layout || saved_first != first || saved_last + 1 < first )
+        return false;
+
+    planned = saved_last + 1 - first;
+    branches.swap( saved_branches );
+    copies.swap( saved_copies );
+
+    return true;
+}
+
+bool Plan::save( const string& fname_ ) const
+{
+    const string tmp_fname( fname_ + ".tmp" );
+    ofstream output( tmp_fname.c_str(), ofstream::out | ofstream::trunc );
+
+    output << plan_magic << '\n'
+           << "uuid " << uuid << '\n'
+           << "layout " << layout << '\n'
+           << "revisions " << first << ' ' << last() << '\n';
+
+    for ( map< string, bool >::const_iterator it = branches.begin(); it != branches.end(); ++it )
+        output << "branch " << ( it->second? '1': '0' ) << '\t' << it->first << '\n';
+
+    for ( set< pair< string, string > >::const_iterator it = copies.begin(); it != copies.end(); ++it )
+        output << "copy " << it->first << '\t' << it->second << '\n';
+
+    output.close();
+
+    if ( !output || rename( tmp_fname.c_str(), fname_.c_str() ) != 0 )
+    {
+        Error::report( "Cannot write the plan to '" + fname_ + "'" );
+        return false;
+    }
+
+    return true;
+}
+
+void Plan::branchCreated( const string& branch_ )
+{
+    branches[branch_] = true;
+}
+
+void Plan::branchDeleted( const string& branch_ )
+{
+    branches[branch_] = false;
+}
+
+void Plan::copied( const string& from_, const string& to_ )
+{
+    if ( from_ != to_ )
+        copies.insert( make_pair( from_, to_ ) );
+}
+
+void Plan::findDeadBranches()
+{
+    // everything but the deleted branches is alive (master, tags, ...)
+    set< string > deleted;
+    for ( map< string, bool >::const_iterator it = branches.begin(); it != branches.end(); ++it )
+        if ( !it->second )
+            deleted.insert( it->first );
+
+    // a deleted branch is alive when it was copied to a living one
+    bool changed = true;
+    while ( changed )
+    {
+        changed = false;
+        for ( set< pair< string, string > >::const_iterator it = copies.begin(); it != copies.end(); ++it )
+        {
+            if ( deleted.find( it->first ) != deleted.end() && deleted.find( it->second ) == deleted.end() )
+            {
+                deleted.erase( it->first );
+                changed = true;
+            }
+        }
+    }
+
+    dead.swap( deleted );
+}
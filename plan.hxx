@@ -0,0 +1,87 @@
+/*
+ * The branches and the copies between them, found before reading any content.
+ *
+ * Author: Jan Holesovsky <kendy@suse.cz>
+ * License: MIT <http://www.opensource.org/licenses/mit-license.php>
+ */
+
+#ifndef _PLAN_HXX_
+#define _PLAN_HXX_
+
+#include <map>
+#include <set>
+#include <string>
+#include <utility>
+
+/// Result of a pass over the changed paths of the revisions (no content):
+/// follows the branches (in branches/, not the tags), and what was copied
+/// from them where, to find the dead branches - deleted branches that
+/// nothing was copied from to a branch or tag that is still alive.
+///
+/// The plan can be saved, and used again as long as the svn repository and
+/// the layout stay the same; when there are new revisions, only those have
+/// to be planned.
+class Plan
+{
+    /// Of the svn repository.
+    std::string uuid;
+
+    /// Checksum of the layout file.
+    std::string layout;
+
+    /// The first planned revision.
+    unsigned int first;
+
+    /// How many revisions from 'first' on are planned.
+    unsigned int planned;
+
+    /// Branch -> does it exist after the last planned revision?
+    std::map< std::string, bool > branches;
+
+    /// Something from the branch 'first' was copied to 'second' (a branch, tag, or master).
+    std::set< std::pair< std::string, std::string > > copies;
+
+    /// Result of findDeadBranches().
+    std::set< std::string > dead;
+
+public:
+    Plan( const std::string& uuid_, const char* layout_fname_, unsigned int first_ );
+
+    /// Load the plan saved by save().
+    ///
+    /// Returns false when there is none, or it is for another repository,
+    /// layout, or first revision; the plan stays empty then.
+    bool load( const std::string& fname_ );
+
+    bool save( const std::string& fname_ ) const;
+
+    /// The last planned revision (first - 1 when there is none).
+    unsigned int last() const { return first + planned - 1; }
+
+    /// The revision last() + 1 is planned.
+    void add() { ++planned; }
+
+    /// The branch_ was created (or replaced) in the revision being planned.
+    void branchCreated( const std::string& branch_ );
+
+    /// The branch_ was deleted in the revision being planned.
+    void branchDeleted( const std::string& branch_ );
+
+    /// Something from the branch from_ was copied to to_.
+    void copied( const std::string& from_, const std::string& to_ );
+
+    /// Find the dead branches, after everything is planned.
+    void findDeadBranches();
+
+    /// Is branch_ one of the dead ones?  (Always false before findDeadBranches().)
+    bool isDead( const std::string& branch_ ) const { return dead.find( branch_ ) != dead.end(); }
+
+    /// Keep the branches_ dead, whatever findDeadBranches() says.
+    void keepDead( const std::set< std::string >& branches_ ) { dead.insert( branches_.begin(), branches_.end() ); }
+
+    const std::set< std::string >& deadBranches() const { return dead; }
+
+    unsigned int deadCount() const { return dead.size(); }
+};
+
+#endif // _PLAN_HXX_
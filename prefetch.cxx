@@ -0,0 +1,398 @@
+/*
+ * Read the files of the next revisions in advance, in other threads.
+ *
+ * Author: Jan Holesovsky <kendy@suse.cz>
+ * License: MIT <http://www.opensource.org/licenses/mit-license.php>
+ */
+
+#include "prefetch.hxx"
+#include "filter.hxx"
+
+#include <cstring>
+
+#include <svn_pools.h>
+#include <svn_repos.h>
+
+using namespace std;
+
+Prefetcher::Prefetcher( const string& repos_path_, svn_revnum_t first_, svn_revnum_t last_, unsigned int threads_, TargetName target_name_ )
+    : repos_path( repos_path_ ),
+      target_name( target_name_ ),
+      current( first_ ),
+      next( first_ ),
+      last( last_ ),
+      ahead( 4 * threads_ + 4 ),
+      files_ahead( 16 * threads_ ),
+      bytes( 0 ),
+      stop( false )
+{
+    pthread_mutex_init( &mutex, NULL );
+    pthread_cond_init( &cond, NULL );
+
+    for ( unsigned int i = 0; i < threads_; ++i )
+    {
+        pthread_t thread;
+        if ( pthread_create( &thread, NULL, run, this ) == 0 )
+            threads.push_back( thread );
+    }
+}
+
+Prefetcher::~Prefetcher()
+{
+    pthread_mutex_lock( &mutex );
+    stop = true;
+    pthread_cond_broadcast( &cond );
+    pthread_mutex_unlock( &mutex );
+
+    for ( vector< pthread_t >::const_iterator it = threads.begin(); it != threads.end(); ++it )
+        pthread_join( *it, NULL );
+
+    pthread_cond_destroy( &cond );
+    pthread_mutex_destroy( &mutex );
+}
+
+void Prefetcher::advance( svn_revnum_t rev_ )
+{
+    pthread_mutex_lock( &mutex );
+
+    current = rev_;
+    if ( next < rev_ )
+        next = rev_;
+
+    while ( !revisions.empty() && revisions.begin()->first < rev_ )
+    {
+        const map< string, Content >& changed = revisions.begin()->second.files;
+        for ( map< string, Content >::const_iterator it = changed.begin(); it != changed.end(); ++it )
+            bytes -= it->second.data.size();
+
+        revisions.erase( revisions.begin() );
+    }
+
+    pthread_cond_broadcast( &cond );
+    pthread_mutex_unlock( &mutex );
+}
+
+void Prefetcher::extend( svn_revnum_t last_ )
+{
+    pthread_mutex_lock( &mutex );
+
+    last = last_;
+
+    pthread_cond_broadcast( &cond );
+    pthread_mutex_unlock( &mutex );
+}
+
+bool Prefetcher::take( svn_revnum_t rev_, const char* path_, int rule_, string& content_, bool& filtered_ )
+{
+    bool found = false;
+
+    pthread_mutex_lock( &mutex );
+
+    const FileKey key( rev_, path_ );
+    map< FileKey, File >::iterator file = files.find( key );
+    while ( file != files.end() && file->second.state == File::READING )
+    {
+        pthread_cond_wait( &cond, &mutex );
+        file = files.find( key );
+    }
+
+    if ( file != files.end() )
+    {
+        // when still queued, we read it ourselves
+        if ( file->second.state == File::READ )
+        {
+            bytes -= file->second.content.data.size();
+            found = usable( file->second.content, rule_, content_, filtered_ );
+
+            pthread_cond_broadcast( &cond );
+        }
+        files.erase( file );
+
+        pthread_mutex_unlock( &mutex );
+
+        return found;
+    }
+
+    map< svn_revnum_t, Revision >::iterator revision = revisions.find( rev_ );
+    while ( revision != revisions.end() && revision->second.reading )
+    {
+        pthread_cond_wait( &cond, &mutex );
+        revision = revisions.find( rev_ );
+    }
+
+    if ( revision != revisions.end() )
+    {
+        map< string, Content >::iterator it = revision->second.files.find( path_ );
+        if ( it != revision->second.files.end() )
+        {
+            bytes -= it->second.data.size();
+            found = usable( it->second, rule_, content_, filtered_ );
+            revision->second.files.erase( it );
+
+            pthread_cond_broadcast( &cond );
+        }
+    }
+
+    pthread_mutex_unlock( &mutex );
+
+    return found;
+}
+
+bool Prefetcher::usable( Content& content_, int rule_, string& data_, bool& filtered_ )
+{
+    // filtered for another file (cannot happen with the same target name)
+    if ( content_.rule >= 0 && content_.rule != rule_ )
+        return false;
+
+    data_.swap( content_.data );
+    filtered_ = ( content_.rule >= 0 );
+
+    return true;
+}
+
+void Prefetcher::request( svn_revnum_t rev_, const string& path_, const string& target_ )
+{
+    pthread_mutex_lock( &mutex );
+
+    const FileKey key( rev_, path_ );
+    if ( files.find( key ) == files.end() )
+    {
+        files[key].target = target_;
+        requested.push_back( key );
+
+        pthread_cond_broadcast( &cond );
+    }
+
+    pthread_mutex_unlock( &mutex );
+}
+
+void Prefetcher::forget( svn_revnum_t rev_, const string& path_ )
+{
+    pthread_mutex_lock( &mutex );
+
+    map< FileKey, File >::iterator file = files.find( FileKey( rev_, path_ ) );
+    if ( file != files.end() )
+    {
+        if ( file->second.state == File::READING )
+            file->second.wanted = false;
+        else
+        {
+            if ( file->second.state == File::READ )
+            {
+                bytes -= file->second.content.data.size();
+                pthread_cond_broadcast( &cond );
+            }
+            files.erase( file );
+        }
+    }
+
+    pthread_mutex_unlock( &mutex );
+}
+
+void* Prefetcher::run( void* this_ )
+{
+    static_cast< Prefetcher* >( this_ )->work();
+    return NULL;
+}
+
+void Prefetcher::work()
+{
+    // svn_fs_t cannot be shared between threads
+    apr_pool_t* pool = svn_pool_create( NULL );
+
+    svn_repos_t* repos;
+    svn_error_t* err = svn_repos_open( &repos, repos_path.c_str(), pool );
+    if ( err )
+    {
+        // the export reads everything itself then
+        svn_error_clear( err );
+        svn_pool_destroy( pool );
+        return;
+    }
+    svn_fs_t* fs = svn_repos_fs( repos );
+
+    apr_pool_t* revpool = svn_pool_create( pool );
+
+    pthread_mutex_lock( &mutex );
+    while ( !stop )
+    {
+        // the export is waiting for the requested files
+        if ( !requested.empty() && bytes < max_bytes )
+        {
+            const FileKey key = requested.front();
+            requested.pop_front();
+
+            map< FileKey, File >::iterator file = files.find( key );
+            if ( file == files.end() || file->second.state != File::QUEUED )
+                continue;
+
+            file->second.state = File::READING;
+            const string target( file->second.target );
+
+            pthread_mutex_unlock( &mutex );
+
+            Content content;
+            bool complete = false;
+            svn_pool_clear( revpool );
+
+            svn_fs_root_t *root;
+            err = svn_fs_revision_root( &root, fs, key.first, revpool );
+            if ( !err )
+                err = readFile( root, key.second.c_str(), content.data, complete, revpool );
+            if ( err )
+            {
+                svn_error_clear( err );
+                complete = false;
+            }
+
+            if ( complete )
+                filter( target, content );
+
+            pthread_mutex_lock( &mutex );
+
+            // nobody removes it while we are reading it
+            file = files.find( key );
+            if ( complete && file->second.wanted )
+            {
+                file->second.content.data.swap( content.data );
+                file->second.content.rule = content.rule;
+                file->second.state = File::READ;
+                bytes += file->second.content.data.size();
+            }
+            else
+                files.erase( file );
+
+            pthread_cond_broadcast( &cond );
+            continue;
+        }
+
+        if ( next > last || next >= current + ahead || bytes >= max_bytes )
+        {
+            pthread_cond_wait( &cond, &mutex );
+            continue;
+        }
+
+        const svn_revnum_t rev = next++;
+        revisions[rev];
+
+        pthread_mutex_unlock( &mutex );
+
+        map< string, Content > changed;
+        svn_pool_clear( revpool );
+        svn_error_clear( read( fs, rev, changed, revpool ) );
+
+        pthread_mutex_lock( &mutex );
+
+        // the export might have moved past it already
+        map< svn_revnum_t, Revision >::iterator revision = revisions.find( rev );
+        if ( revision != revisions.end() )
+        {
+            for ( map< string, Content >::const_iterator it = changed.begin(); it != changed.end(); ++it )
+                bytes += it->second.data.size();
+
+            revision->second.files.swap( changed );
+            revision->second.reading = false;
+        }
+
+        pthread_cond_broadcast( &cond );
+    }
+    pthread_mutex_unlock( &mutex );
+
+    svn_pool_destroy( pool );
+}
+
+svn_error_t* Prefetcher::read( svn_fs_t* fs_, svn_revnum_t rev_, map< string, Content >& files_, apr_pool_t* pool_ )
+{
+    svn_fs_root_t *root;
+    SVN_ERR( svn_fs_revision_root( &root, fs_, rev_, pool_ ) );
+
+    apr_hash_t *changes;
+    SVN_ERR( svn_fs_paths_changed2( &changes, root, pool_ ) );
+
+    apr_pool_t *subpool = svn_pool_create( pool_ );
+
+    for ( apr_hash_index_t *i = apr_hash_first( pool_, changes ); i; i = apr_hash_next( i ) )
+    {
+        svn_pool_clear( subpool );
+
+        const void *key;
+        void *val;
+        apr_hash_this( i, &key, NULL, &val );
+        const char *path = static_cast< const char* >( key );
+        const svn_fs_path_change2_t *change = static_cast< const svn_fs_path_change2_t* >( val );
+
+        // the export does not care about anything in the toplevel, and
+        // skips the files where only the properties changed
+        if ( change->change_kind == svn_fs_path_change_delete ||
+             ( change->change_kind == svn_fs_path_change_modify && !change->text_mod ) ||
+             path[0] != '/' || strchr( path + 1, '/' ) == NULL )
+            continue;
+
+        // not exported at all
+        string target;
+        if ( target_name && !target_name( path, target ) )
+            continue;
+
+        svn_node_kind_t kind;
+        SVN_ERR( svn_fs_check_path( &kind, root, path, subpool ) );
+        if ( kind != svn_node_file )
+            continue;
+
+        Content content;
+        bool complete;
+        SVN_ERR( readFile( root, path, content.data, complete, subpool ) );
+        if ( !complete )
+            continue;
+
+        filter( target, content );
+
+        Content& file = files_[path];
+        file.data.swap( content.data );
+        file.rule = content.rule;
+    }
+
+    svn_pool_destroy( subpool );
+
+    return SVN_NO_ERROR;
+}
+
+svn_error_t* Prefetcher::readFile( svn_fs_root_t* root_, const char* path_, string& content_, bool& read_, apr_pool_t* pool_ )
+{
+    read_ = false;
+
+    svn_filesize_t length;
+    SVN_ERR( svn_fs_file_length( &length, root_, path_, pool_ ) );
+    if ( length > static_cast< svn_filesize_t >( max_file_size ) )
+        return SVN_NO_ERROR;
+
+    svn_stream_t *stream;
+    SVN_ERR( svn_fs_file_contents( &stream, root_, path_, pool_ ) );
+
+    content_.reserve( length );
+
+    char buffer[16384];
+    apr_size_t len;
+    do {
+        len = sizeof( buffer );
+        SVN_ERR( svn_stream_read( stream, buffer, &len ) );
+        content_.append( buffer, len );
+    } while ( len > 0 );
+
+    read_ = true;
+
+    return SVN_NO_ERROR;
+}
+
+void Prefetcher::filter( const string& target_, Content& content_ )
+{
+    if ( target_.empty() )
+        return;
+
+    Filter filter( target_ );
+    if ( !filter.changesContent() )
+        return;
+
+    filter.addData( content_.data );
+    filter.finish( content_.data );
+    content_.rule = filter.getRule();
+}
@@ -0,0 +1,180 @@
+/*
+ * Read the files of the next revisions in advance, in other threads.
+ *
+ * Author: Jan Holesovsky <kendy@suse.cz>
+ * License: MIT <http://www.opensource.org/licenses/mit-license.php>
+ */
+
+#ifndef _PREFETCH_HXX_
+#define _PREFETCH_HXX_
+
+#include <deque>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <pthread.h>
+
+#include <svn_fs.h>
+
+/// Reads the content of the files changed in the revisions that follow the
+/// one we are exporting, so that the reading from the disk overlaps with the
+/// filtering and the output.
+///
+/// It also reads the files of the trees that are copied, when the export asks
+/// for them - those are read before the next revisions.
+///
+/// The threads also run the filter over what they read (when they know the
+/// target file name), so both the reading and the filtering scale with the
+/// number of threads.
+///
+/// Every thread has its own svn_fs_t and pool; the export itself stays in
+/// the main thread, and just takes the content from here when available, so
+/// the output does not change.
+class Prefetcher
+{
+public:
+    /// Name of the file in the output for the svn path_; false when we do not
+    /// export it (and so do not have to read it).
+    typedef bool (*TargetName)( const char* path_, std::string& fname_ );
+
+private:
+    /// Content of a file.
+    struct Content
+    {
+        std::string data;
+
+        /// Rule of the Filter that changed the data, -1 when it is as in svn.
+        int rule;
+
+        Content() : data(), rule( -1 ) {}
+    };
+
+    /// Files of one revision.
+    struct Revision
+    {
+        /// Still being read.
+        bool reading;
+
+        /// Path -> content.
+        std::map< std::string, Content > files;
+
+        Revision() : reading( true ), files() {}
+    };
+
+    /// File requested by the export.
+    struct File
+    {
+        enum State { QUEUED, READING, READ } state;
+
+        /// When false, the thread drops it after reading.
+        bool wanted;
+
+        /// Name of the file in the output, for the filter.
+        std::string target;
+
+        Content content;
+
+        File() : state( QUEUED ), wanted( true ), target(), content() {}
+    };
+
+    typedef std::pair< svn_revnum_t, std::string > FileKey;
+
+    std::string repos_path;
+
+    /// Gives the target names for the files of the revisions.
+    TargetName target_name;
+
+    pthread_mutex_t mutex;
+
+    /// Signalled when something changes - a revision is read, the export moves on, ...
+    pthread_cond_t cond;
+
+    std::vector< pthread_t > threads;
+
+    /// Revision that we are exporting now.
+    svn_revnum_t current;
+
+    /// Revision that should be read next.
+    svn_revnum_t next;
+
+    /// The last one to read.
+    svn_revnum_t last;
+
+    /// How many revisions after the current one to read.
+    svn_revnum_t ahead;
+
+    std::map< svn_revnum_t, Revision > revisions;
+
+    std::map< FileKey, File > files;
+
+    /// Requested files in the order of the requests; some of them might be
+    /// taken or forgotten in the meantime.
+    std::deque< FileKey > requested;
+
+    /// How many files of a copied tree to request in advance.
+    size_t files_ahead;
+
+    /// Size of all the content we hold.
+    size_t bytes;
+
+    bool stop;
+
+    /// Bigger files are left for the export to read (and stream).
+    static const size_t max_file_size = 4*1024*1024;
+
+    /// Do not read more when we hold this much.
+    static const size_t max_bytes = 128*1024*1024;
+
+public:
+    /// Start threads_ threads reading the revisions first_..last_ of the
+    /// repository in repos_path_; the content is filtered already when
+    /// target_name_ tells the name of the file in the output.
+    Prefetcher( const std::string& repos_path_, svn_revnum_t first_, svn_revnum_t last_, unsigned int threads_, TargetName target_name_ = NULL );
+
+    ~Prefetcher();
+
+    /// We start exporting the revision rev_, forget everything before it.
+    void advance( svn_revnum_t rev_ );
+
+    /// There are new revisions in the repository, read up to last_.
+    void extend( svn_revnum_t last_ );
+
+    /// Take the content of path_ in the revision rev_, for the Filter with the rule rule_.
+    ///
+    /// filtered_ tells whether the content went through that filter already.
+    ///
+    /// Waits when the revision (or the requested file) is still being read;
+    /// returns false when the file is not prefetched.
+    bool take( svn_revnum_t rev_, const char* path_, int rule_, std::string& content_, bool& filtered_ );
+
+    /// Read path_ in the revision rev_ (that can be any revision) in advance,
+    /// and filter it for the output file target_.
+    void request( svn_revnum_t rev_, const std::string& path_, const std::string& target_ );
+
+    /// The requested file is not needed any more (was not taken).
+    void forget( svn_revnum_t rev_, const std::string& path_ );
+
+    size_t filesAhead() const { return files_ahead; }
+
+private:
+    static void* run( void* this_ );
+
+    /// Body of the threads.
+    void work();
+
+    /// Read the files changed in rev_ to files_.
+    svn_error_t* read( svn_fs_t* fs_, svn_revnum_t rev_, std::map< std::string, Content >& files_, apr_pool_t* pool_ );
+
+    /// Read path_ in rev_ to content_; read_ is false when it is too big.
+    svn_error_t* readFile( svn_fs_root_t* root_, const char* path_, std::string& content_, bool& read_, apr_pool_t* pool_ );
+
+    /// Hand over content_ to take(), unless it is filtered with another rule than rule_.
+    static bool usable( Content& content_, int rule_, std::string& data_, bool& filtered_ );
+
+    /// Run the filter for target_ over content_ (when it changes anything).
+    static void filter( const std::string& target_, Content& content_ );
+};
+
+#endif // _PREFETCH_HXX_
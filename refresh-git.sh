@@ -78,47 +78,27 @@ else
     fi
 fi
 
-WD=`pwd`
-
 for I in `sed -e 's/^[#:].*//' -e 's/^ignore-.*//' -e 's/=.*//' "$LAYOUT" | grep -v '^$'` ; do
     echo "$I" | sed 's/:/ /' | (
         read NAME COMMIT
-	rm $NAME.dump
-        mkfifo $NAME.dump
-        (
-	    cd "$GIT_BASE/$NAME" ;
-	    found=$(git branch | grep " $BRANCH")
-	    if [ -z "$found" ] ; then
-		git checkout -b "${BRANCH}" "$COMMIT"
-	    else
-		git checkout ${BRANCH}
-	    fi
-	    git reset -q --hard "$COMMIT";
-	    git fast-import < "$WD"/$NAME.dump
-	    git checkout -f
-	) &
+        cd "$GIT_BASE/$NAME" ;
+        found=$(git branch | grep " $BRANCH")
+        if [ -z "$found" ] ; then
+            git checkout -b "${BRANCH}" "$COMMIT"
+        else
+            git checkout ${BRANCH}
+        fi
+        git reset -q --hard "$COMMIT"
     )
 done
 
-# execute hg-fast-export, or svn-fast-export
-${BIN_DIR}/hg-fast-export "$HG_REPO" "$COMMITTERS" "$LAYOUT"
+# execute hg-fast-export; it runs git fast-import for every repository
+# itself, waits for them, and removes the tag-branches/
+${BIN_DIR}/hg-fast-export --target="$GIT_BASE" "$HG_REPO" "$COMMITTERS" "$LAYOUT"
 RETURN_VALUE=$?
 
-# wait until everything's finished
-while [ -n "`jobs`" ] ; do
-    echo jobs:
-    jobs
-    sleep 1
-done
-
-# wait one more minute for everything to settle down
-# FIXME rather find a real solution...
-sleep 60
-
 for I in `sed -e 's/^[#:].*//' -e 's/^ignore-.*//' -e 's/=.*//' -e 's/:.*//' "$LAYOUT" | grep -v '^$'` ; do
-    ( cd "$GIT_BASE/$I" ; echo `pwd` ; git branch | sed 's/^\*/ /' | grep 'tag-branches/' | xargs git branch -D )
-    rm $I.dump
+    ( cd "$GIT_BASE/$I" ; git checkout -f )
 done
 
 exit $RETURN_VALUE
-
@@ -6,27 +6,33 @@
  * License: MIT <http://www.opensource.org/licenses/mit-license.php>
  */
 
+#include "asyncbuf.hxx"
 #include "committers.hxx"
 #include "error.hxx"
+#include "fastimport.hxx"
 #include "filter.hxx"
 #include "repository.hxx"
 
+#include <algorithm>
 #include <cstdlib>
 #include <cstring>
 #include <iomanip>
 #include <iostream>
 #include <set>
-#include <sstream>
 #include <vector>
 
+#include <pthread.h>
+
 using namespace std;
 
 typedef vector< Repository* > Repos;
 typedef set< string > Branches;
 typedef set< unsigned int > RevisionIgnore;
 typedef set< string > TagIgnore;
-typedef vector< string > BranchIds;
+typedef map< string, BranchId > BranchIds;
 typedef vector< Tag* > Tags;
+typedef map< string, Tag* > TagBranches;
+typedef set< pair< unsigned int, Tag* > > PendingTags;
 
 static Repos repos;
 static Branches branches;
@@ -34,6 +40,16 @@ static RevisionIgnore revision_ignore;
 static TagIgnore tag_ignore;
 static BranchIds branch_ids; // needed in addition to 'branches' because here we create the ids on demand
 static Tags tags;
+static TagBranches tag_branches; // tag_branch -> the tag
+static PendingTags pending_tags; // tags to write once they do not change for 'tag_finalize' revisions; ordered by the last change
+static unsigned int tag_finalize = 0; // when 0, the tags are written only in Repositories::close()
+static string target_dir; // when not empty, we start the git fast-imports ourselves
+static bool resumable = false; // the git fast-imports keep the marks for Repositories::saveState()
+static unsigned int tables_max_revs = 0; // max_revs of the repositories, the size of their tables
+static set< string > selection; // names of the repositories to write, all when empty
+static set< string > pruned_branches; // never exported (--prune-dead-branches), kept in the state
+static PathRegexList routing; // regexes of the repos, in the same order
+static pthread_mutex_t routing_mutex = PTHREAD_MUTEX_INITIALIZER; // the prefetching threads ask isSelected() too
 
 struct CommitMessages
 {
@@ -68,15 +84,33 @@ struct CommitMessages
 
 static CommitMessages commit_messages;
 
-static BranchId branchId( const string& branch_ )
+/// For upper_bound() in the commits of a branch.
+static bool revBefore( unsigned int rev_, const BranchCommit& commit_ )
+{
+    return rev_ < commit_.rev;
+}
+
+/// Append the number to str_; cheaper than an ostringstream for every line.
+static void appendNumber( string& str_, unsigned int number_ )
 {
-    BranchId id = 1;
-    BranchIds::const_iterator it = branch_ids.begin();
+    char buffer[16];
+    char* it = buffer + sizeof( buffer );
+    do {
+        *--it = '0' + number_ % 10;
+        number_ /= 10;
+    } while ( number_ > 0 );
+
+    str_.append( it, buffer + sizeof( buffer ) - it );
+}
 
-    for ( ; ( it != branch_ids.end() ) && ( *it != branch_ ); ++it, ++id );
+static BranchId branchId( const string& branch_ )
+{
+    BranchIds::const_iterator it = branch_ids.find( branch_ );
+    if ( it != branch_ids.end() )
+        return it->second;
 
-    if ( it == branch_ids.end() )
-        branch_ids.push_back( branch_ );
+    BranchId id = branch_ids.size() + 1;
+    branch_ids[branch_] = id;
 
     return id;
 }
@@ -217,8 +251,8 @@ Time::Time( double time_, int timezone_ )
 {
 }
 
-Tag::Tag( const Committer& committer_, const std::string& name_, Time time_, const std::string& log_ )
-    : name( name_ ), tag_branch( name_ ), committer( committer_ ), time( time_ ), log( commitMessage( log_ ) )
+Tag::Tag( const Committer& committer_, const std::string& name_, Time time_, const std::string& log_, unsigned int last_change_ )
+    : name( name_ ), tag_branch( name_ ), committer( committer_ ), time( time_ ), log( commitMessage( log_ ) ), last_change( last_change_ )
 {
     const size_t tag_branches_len = strlen( TAG_TEMP_BRANCH );
     if ( name.compare( 0, tag_branches_len, TAG_TEMP_BRANCH ) == 0 )
@@ -227,33 +261,61 @@ Tag::Tag( const Committer& committer_, const std::string& name_, Time time_, con
         Error::report( "Cannot guess the branch name for '" + name_ + "'" );
 }
 
-Repository::Repository( const std::string& reponame_, const string& regex_, unsigned int max_revs_, bool cleanup_first_ )
+Repository::Repository( const std::string& reponame_, const string& regex_, unsigned int first_rev_, unsigned int max_revs_, bool cleanup_first_ )
     : mark( 1 ),
-      out( ( reponame_ + ".dump" ).c_str() ),
-      commits( new BranchId[max_revs_ + 10] ),
-      parents( new string[max_revs_ + 10] ),
+      fast_import( NULL ),
+      async_out( NULL ),
+      out( NULL ),
+      selected( selection.empty() || selection.find( reponame_ ) != selection.end() ),
+      branch_commits(),
+      parents( max_revs_ + 10 - min( first_rev_, max_revs_ ), -1 ),
+      commit_marks( parents.size(), 0 ),
+      first_rev( min( first_rev_, max_revs_ ) ),
       max_revs( max_revs_ ),
       name( reponame_ ),
       cleanup_first( cleanup_first_ )
 {
-    int status = regcomp( &regex_rule, regex_.c_str(), REG_EXTENDED | REG_NOSUB );
-    if ( status != 0 )
+    if ( !regex_rule.compile( regex_ ) )
         Error::report( "Cannot create regex '" + regex_ + "'" );
 
-    memset( commits, 0, ( max_revs_ + 10 ) * sizeof( BranchId ) );
+    if ( !selected )
+        return;
+
+    if ( target_dir.empty() )
+    {
+        file.open( ( reponame_ + ".dump" ).c_str(), ios_base::out | ios_base::trunc );
+        async_out = new AsyncOutBuf( &file );
+    }
+    else
+    {
+        const string git_dir( target_dir + "/" + reponame_ );
+        fast_import = new FastImport( git_dir, resumable? git_dir + ".marks": string() );
+        async_out = new AsyncOutBuf( fast_import->rdbuf() );
+    }
+    out.rdbuf( async_out );
+
+    // so that fast-import fails when we do not finish the stream
+    out << "feature done\n";
 }
 
 Repository::~Repository()
 {
-    regfree( &regex_rule );
-    delete[] commits;
-    delete[] parents;
-    out.close();
+    for ( set< string >::const_iterator it = tag_branch_refs.begin(); it != tag_branch_refs.end(); ++it )
+        out << "reset refs/heads/" << *it << "\nfrom 0000000000000000000000000000000000000000\n\n";
+
+    out << "done\n";
+
+    out.rdbuf( NULL );
+    delete async_out;
+    if ( fast_import )
+        delete fast_import;
+    else if ( file.is_open() )
+        file.close();
 }
 
 bool Repository::matches( const std::string& fname_ ) const
 {
-    return ( regexec( &regex_rule, fname_.c_str(), 0, NULL, 0 ) == 0 );
+    return regex_rule.matches( fname_ );
 }
 
 void Repository::deleteFile( const std::string& fname_ )
@@ -263,31 +325,106 @@ void Repository::deleteFile( const std::string& fname_ )
     file_changes.append( "\n" );
 }
 
-ostream& Repository::modifyFile( const std::string& fname_, const char* mode_ )
+void Repository::addModification( const std::string& fname_, const char* mode_, unsigned int mark_, const std::string& node_key_ )
+{
+    if ( !node_key_.empty() )
+        node_blobs[node_key_] = NodeBlob( mark_, mode_ );
+
+    file_changes.append( "M " );
+    file_changes.append( mode_ );
+    file_changes.append( " :" );
+    appendNumber( file_changes, mark_ );
+    file_changes.append( " " );
+    file_changes.append( fname_ );
+    file_changes.append( "\n" );
+}
+
+ostream& Repository::modifyFile( const std::string& fname_, const char* mode_, const std::string& blob_key_, const std::string& node_key_ )
 {
-    ostringstream sstr;
+    if ( !blob_key_.empty() )
+        blob_marks[blob_key_] = mark;
 
-    sstr << "M " << mode_ << " :" << mark << " " << fname_ << "\n";
-    
-    file_changes.append( sstr.str() );
+    addModification( fname_, mode_, mark, node_key_ );
 
     // write the file header
-    out << "blob" << endl
-        << "mark :" << mark << endl;
+    out << "blob\nmark :" << mark << '\n';
 
     ++mark;
 
     return out;
 }
 
+bool Repository::reuseBlob( const std::string& fname_, const char* mode_, const std::string& blob_key_, const std::string& node_key_ )
+{
+    map< string, unsigned int >::const_iterator it = blob_marks.find( blob_key_ );
+    if ( it == blob_marks.end() )
+        return false;
+
+    addModification( fname_, mode_, it->second, node_key_ );
+
+    return true;
+}
+
+bool Repository::reuseNode( const std::string& fname_, const std::string& node_key_ )
+{
+    map< string, NodeBlob >::const_iterator it = node_blobs.find( node_key_ );
+    if ( it == node_blobs.end() )
+        return false;
+
+    addModification( fname_, it->second.mode.c_str(), it->second.mark, string() );
+
+    return true;
+}
+
+bool Repository::copyTree( unsigned int from_, const std::string& from_branch_, const std::string& fname_ )
+{
+    // nothing to write
+    if ( !selected )
+        return true;
+
+    if ( !fast_import || !fast_import->isRunning() )
+        return false;
+
+    // nothing from this branch in this repository
+    BranchCommit from = findCommit( from_, from_branch_ );
+    if ( from.rev == 0 )
+        return true;
+
+    out << "ls :" << from.mark << " " << fname_ << "\n";
+    async_out->drain();
+
+    // <mode> SP <type> SP <sha1> HT <path>, or missing SP <path>
+    string answer = fast_import->readLine();
+    if ( answer.compare( 0, 8, "missing " ) == 0 )
+        return true;
+
+    size_t space1 = answer.find( ' ' );
+    size_t space2 = ( space1 == string::npos )? string::npos: answer.find( ' ', space1 + 1 );
+    size_t tab = ( space2 == string::npos )? string::npos: answer.find( '\t', space2 + 1 );
+    if ( tab == string::npos )
+    {
+        Error::report( "Unexpected answer from git fast-import: '" + answer + "'" );
+        return false;
+    }
+
+    file_changes.append( "M " );
+    file_changes.append( answer, 0, space1 );
+    file_changes.append( answer, space2, tab - space2 );
+    file_changes.append( " " );
+    file_changes.append( fname_ );
+    file_changes.append( "\n" );
+
+    return true;
+}
+
 void Repository::commit( const Committer& committer_, const std::string& name_, unsigned int commit_id_, Time time_, const std::string& log_, const std::vector< int >& merges_, bool force_ )
 {
     if ( force_ || !file_changes.empty() )
     {
         out << "commit refs/heads/" << name_ << "\n";
 
-        if ( commit_id_ )
-            out << "mark :" << ( 100000 + commit_id_ ) << "\n";
+        const unsigned int commit_mark = mark++;
+        out << "mark :" << commit_mark << "\n";
 
         string log( commitMessage( log_ ) );
 
@@ -299,60 +436,83 @@ void Repository::commit( const Committer& committer_, const std::string& name_,
         bool first = true;
         for ( vector< int >::const_iterator it = merges_.begin(); it != merges_.end(); ++it )
         {
-            if ( !parents[(*it)].empty() )
+            int parent = parentOf( *it );
+            if ( parent >= 0 )
             {
-                out << ( first? "from ": "merge " ) << parents[(*it)] << "\n";
+                out << ( first? "from ": "merge " ) << commitRef( parent ) << "\n";
                 first = false;
             }
         }
 
         if ( cleanup_first )
         {
-            out << "deleteall" << endl;
+            out << "deleteall\n";
             cleanup_first = false;
         }
 
         out << file_changes
-            << endl;
+            << '\n';
+
+        if ( name_.compare( 0, strlen( TAG_TEMP_BRANCH ), TAG_TEMP_BRANCH ) == 0 )
+            tag_branch_refs.insert( name_ );
 
-        commits[commit_id_] = branchId( name_ );
+        if ( inTables( commit_id_ ) )
+        {
+            BranchId branch_id = branchId( name_ );
+            if ( branch_id >= branch_commits.size() )
+                branch_commits.resize( branch_id + 1 );
 
-        ostringstream sstr;
-        sstr << ":" << ( 100000 + commit_id_ );
+            // we commit in the order of the revisions, so this is a push_back
+            vector< BranchCommit >& commits = branch_commits[branch_id];
+            commits.insert( upper_bound( commits.begin(), commits.end(), commit_id_, revBefore ), BranchCommit( commit_id_, commit_mark ) );
 
-        parents[commit_id_] = sstr.str();
+            parents[commit_id_ - first_rev] = commit_id_;
+            commit_marks[commit_id_ - first_rev] = commit_mark;
+        }
+        mapped_commits.erase( commit_id_ );
     }
     else
     {
         // try to setup a parent chain (if we don't succeed, we have to
         // completely initialize the missing pieces - more work)
-        if ( merges_.size() > 0 && !parents[merges_[0]].empty() )
-            parents[commit_id_] = parents[merges_[0]];
+        if ( merges_.size() > 0 && inTables( commit_id_ ) )
+        {
+            int parent = parentOf( merges_[0] );
+            if ( parent >= 0 )
+                parents[commit_id_ - first_rev] = parent;
+        }
     }
 
     file_changes.clear();
-    mark = 1;
 }
 
 void Repository::createBranch( unsigned int from_, const std::string& from_branch_,
         const Committer& committer_, const std::string& name_, unsigned int commit_id_, Time time_, const std::string& log_ )
 {
-    unsigned int from = findCommit( from_, from_branch_ );
-    if ( from == 0 )
+    BranchCommit from = findCommit( from_, from_branch_ );
+    if ( from.rev == 0 )
         return;
 
-    out << "reset refs/heads/" << name_ << "\nfrom :" << 100000 + from << "\n" << endl;
+    out << "reset refs/heads/" << name_ << "\nfrom :" << from.mark << "\n\n";
 
     commit( committer_, name_, commit_id_, time_, log_, vector< int >(), true );
 }
 
 void Repository::createTag( const Tag& tag_ )
 {
-    unsigned int from = findCommit( max_revs, tag_.tag_branch );
-    if ( from == 0 )
+    BranchCommit from = findCommit( max_revs, tag_.tag_branch );
+    if ( from.rev == 0 )
+        return;
+
+    // written already, when the branch stopped changing
+    map< string, int >::iterator written = written_tags.find( tag_.name );
+    if ( written != written_tags.end() && written->second == static_cast< int >( from.rev ) )
         return;
+    written_tags[tag_.name] = from.rev;
 
-    createTag( tag_.name, from, false, tag_.committer, tag_.time, tag_.log );
+    string ref( ":" );
+    appendNumber( ref, from.mark );
+    writeTag( tag_.name, ref, tag_.committer, tag_.time, tag_.log );
 }
 
 void Repository::createTag( const std::string& name_, int rev_, bool lookup_in_parents_,
@@ -363,47 +523,298 @@ void Repository::createTag( const std::string& name_, int rev_, bool lookup_in_p
     {
         if ( written_tags[name_] != rev_ )
         {
-            from = parents[rev_];
+            int parent = parentOf( rev_ );
+            if ( parent >= 0 )
+                from = commitRef( parent );
             written_tags[name_] = rev_;
         }
     }
     else
-    {
-        ostringstream ostr;
-        ostr << ':' << rev_;
-        from = ostr.str();
-    }
+        from = commitRef( rev_ );
+
+    writeTag( name_, from, committer_, time_, log_ );
+}
 
-    if ( from.empty() || from == "ignore" )
+void Repository::writeTag( const std::string& name_, const std::string& from_, const Committer& committer_, Time time_, const std::string& log_ )
+{
+    if ( from_.empty() || from_ == "ignore" )
         return;
 
     out << "tag " << name_
-        << "\nfrom " << from
+        << "\nfrom " << from_
         << "\ntagger " << committer_.name << " <" << committer_.email << "> " << time_
         << "\ndata " << log_.length() << "\n"
         << log_
-        << endl;
+        << '\n';
+}
+
+void Repository::checkpoint()
+{
+    out << "checkpoint\n\n";
+}
+
+bool Repository::failed() const
+{
+    return fast_import && fast_import->hasFailed();
+}
+
+bool Repository::sync()
+{
+    // nothing written
+    if ( !selected )
+        return true;
+
+    if ( !fast_import || !fast_import->isRunning() )
+        return false;
+
+    out << FastImport::syncCommand();
+    async_out->drain();
+
+    return FastImport::isSyncAnswer( fast_import->readLine() );
+}
+
+/// The state is read back on the same machine, the numbers are stored as they are.
+template< typename T > static void writeValue( ostream& out_, T value_ )
+{
+    out_.write( reinterpret_cast< const char* >( &value_ ), sizeof( value_ ) );
+}
+
+template< typename T > static bool readValue( istream& in_, T& value_ )
+{
+    in_.read( reinterpret_cast< char* >( &value_ ), sizeof( value_ ) );
+    return in_.good();
+}
+
+static void writeString( ostream& out_, const string& str_ )
+{
+    writeValue< unsigned int >( out_, str_.size() );
+    out_.write( str_.data(), str_.size() );
+}
+
+static bool readString( istream& in_, string& str_ )
+{
+    unsigned int len;
+    if ( !readValue( in_, len ) )
+        return false;
+
+    str_.resize( len );
+    if ( len > 0 )
+        in_.read( &str_[0], len );
+
+    return in_.good();
+}
+
+void Repository::saveState( ostream& out_ ) const
+{
+    writeValue( out_, mark );
+    writeValue< char >( out_, cleanup_first );
+
+    writeValue< unsigned int >( out_, blob_marks.size() );
+    for ( map< string, unsigned int >::const_iterator it = blob_marks.begin(); it != blob_marks.end(); ++it )
+    {
+        writeString( out_, it->first );
+        writeValue( out_, it->second );
+    }
+
+    writeValue< unsigned int >( out_, node_blobs.size() );
+    for ( map< string, NodeBlob >::const_iterator it = node_blobs.begin(); it != node_blobs.end(); ++it )
+    {
+        writeString( out_, it->first );
+        writeValue( out_, it->second.mark );
+        writeString( out_, it->second.mode );
+    }
+
+    writeValue< unsigned int >( out_, branch_commits.size() );
+    for ( vector< vector< BranchCommit > >::const_iterator it = branch_commits.begin(); it != branch_commits.end(); ++it )
+    {
+        writeValue< unsigned int >( out_, it->size() );
+        if ( !it->empty() )
+            out_.write( reinterpret_cast< const char* >( &(*it)[0] ), it->size() * sizeof( BranchCommit ) );
+    }
+
+    writeValue( out_, first_rev );
+    writeValue< unsigned int >( out_, parents.size() );
+    if ( !parents.empty() )
+        out_.write( reinterpret_cast< const char* >( &parents[0] ), parents.size() * sizeof( int ) );
+    if ( !commit_marks.empty() )
+        out_.write( reinterpret_cast< const char* >( &commit_marks[0] ), commit_marks.size() * sizeof( unsigned int ) );
+
+    writeValue< unsigned int >( out_, mapped_commits.size() );
+    for ( map< int, string >::const_iterator it = mapped_commits.begin(); it != mapped_commits.end(); ++it )
+    {
+        writeValue( out_, it->first );
+        writeString( out_, it->second );
+    }
+
+    writeValue< unsigned int >( out_, written_tags.size() );
+    for ( map< string, int >::const_iterator it = written_tags.begin(); it != written_tags.end(); ++it )
+    {
+        writeString( out_, it->first );
+        writeValue( out_, it->second );
+    }
+
+    writeValue< unsigned int >( out_, tag_branch_refs.size() );
+    for ( set< string >::const_iterator it = tag_branch_refs.begin(); it != tag_branch_refs.end(); ++it )
+        writeString( out_, *it );
+}
+
+bool Repository::loadState( istream& in_ )
+{
+    char cleanup;
+    unsigned int count;
+    if ( !readValue( in_, mark ) || !readValue( in_, cleanup ) )
+        return false;
+    cleanup_first = cleanup;
+
+    blob_marks.clear();
+    if ( !readValue( in_, count ) )
+        return false;
+    for ( unsigned int i = 0; i < count; ++i )
+    {
+        string key;
+        unsigned int blob_mark;
+        if ( !readString( in_, key ) || !readValue( in_, blob_mark ) )
+            return false;
+        blob_marks[key] = blob_mark;
+    }
+
+    node_blobs.clear();
+    if ( !readValue( in_, count ) )
+        return false;
+    for ( unsigned int i = 0; i < count; ++i )
+    {
+        string key, mode;
+        unsigned int blob_mark;
+        if ( !readString( in_, key ) || !readValue( in_, blob_mark ) || !readString( in_, mode ) )
+            return false;
+        node_blobs[key] = NodeBlob( blob_mark, mode );
+    }
+
+    if ( !readValue( in_, count ) )
+        return false;
+    branch_commits.assign( count, vector< BranchCommit >() );
+    for ( unsigned int i = 0; i < count; ++i )
+    {
+        unsigned int commits;
+        if ( !readValue( in_, commits ) )
+            return false;
+        branch_commits[i].resize( commits );
+        if ( commits > 0 && !in_.read( reinterpret_cast< char* >( &branch_commits[i][0] ), commits * sizeof( BranchCommit ) ) )
+            return false;
+    }
+
+    // the tables can be bigger now, when there are new revisions
+    unsigned int saved_first_rev;
+    if ( !readValue( in_, saved_first_rev ) || !readValue( in_, count ) )
+        return false;
+    for ( unsigned int i = 0; i < count; ++i )
+    {
+        int parent;
+        if ( !readValue( in_, parent ) )
+            return false;
+        if ( inTables( saved_first_rev + i ) )
+            parents[saved_first_rev + i - first_rev] = parent;
+    }
+    for ( unsigned int i = 0; i < count; ++i )
+    {
+        unsigned int commit_mark;
+        if ( !readValue( in_, commit_mark ) )
+            return false;
+        if ( inTables( saved_first_rev + i ) )
+            commit_marks[saved_first_rev + i - first_rev] = commit_mark;
+    }
+
+    mapped_commits.clear();
+    if ( !readValue( in_, count ) )
+        return false;
+    for ( unsigned int i = 0; i < count; ++i )
+    {
+        int rev;
+        string git_commit;
+        if ( !readValue( in_, rev ) || !readString( in_, git_commit ) )
+            return false;
+        mapped_commits[rev] = git_commit;
+    }
+
+    written_tags.clear();
+    if ( !readValue( in_, count ) )
+        return false;
+    for ( unsigned int i = 0; i < count; ++i )
+    {
+        string tag;
+        int rev;
+        if ( !readString( in_, tag ) || !readValue( in_, rev ) )
+            return false;
+        written_tags[tag] = rev;
+    }
+
+    tag_branch_refs.clear();
+    if ( !readValue( in_, count ) )
+        return false;
+    for ( unsigned int i = 0; i < count; ++i )
+    {
+        string ref;
+        if ( !readString( in_, ref ) )
+            return false;
+        tag_branch_refs.insert( ref );
+    }
+
+    return true;
 }
 
 void Repository::mapCommit( int rev_, const std::string& git_commit_ )
 {
-    parents[rev_] = git_commit_;
+    if ( rev_ < 0 )
+        return;
+
+    mapped_commits[rev_] = git_commit_;
+
+    if ( inTables( rev_ ) )
+        parents[rev_ - first_rev] = rev_;
 }
 
 bool Repository::hasParent( int parent_ )
 {
-    return !parents[parent_].empty();
+    return parentOf( parent_ ) >= 0;
+}
+
+int Repository::parentOf( int commit_id_ ) const
+{
+    if ( inTables( commit_id_ ) )
+        return parents[commit_id_ - first_rev];
+
+    if ( mapped_commits.find( commit_id_ ) != mapped_commits.end() )
+        return commit_id_;
+
+    return -1;
 }
 
-unsigned int Repository::findCommit( unsigned int from_, const std::string& from_branch_ )
+string Repository::commitRef( int commit_id_ ) const
+{
+    map< int, string >::const_iterator it = mapped_commits.find( commit_id_ );
+    if ( it != mapped_commits.end() )
+        return it->second;
+
+    if ( !inTables( commit_id_ ) || commit_marks[commit_id_ - first_rev] == 0 )
+        return string();
+
+    string ref( ":" );
+    appendNumber( ref, commit_marks[commit_id_ - first_rev] );
+    return ref;
+}
+
+BranchCommit Repository::findCommit( unsigned int from_, const std::string& from_branch_ )
 {
     BranchId branch_id = branchId( from_branch_ );
-    unsigned int commit_no = from_;
-    
-    while ( commit_no > 0 && commits[commit_no] != branch_id )
-        --commit_no;
+    if ( branch_id >= branch_commits.size() )
+        return BranchCommit();
 
-    return commit_no;
+    const vector< BranchCommit >& commits = branch_commits[branch_id];
+    vector< BranchCommit >::const_iterator it = upper_bound( commits.begin(), commits.end(), from_, revBefore );
+    if ( it == commits.begin() )
+        return BranchCommit();
+
+    return *( it - 1 );
 }
 
 bool Repositories::load( const char* fname_, unsigned int max_revs_, int& min_rev_, std::string& trunk_base_, std::string& trunk_, std::string& branches_, std::string& tags_ )
@@ -414,6 +825,8 @@ bool Repositories::load( const char* fname_, unsigned int max_revs_, int& min_re
     bool cleanup_first = false;
     bool result = false;
 
+    tables_max_revs = max_revs_;
+
     while ( !input.eof() )
     {
         getline( input, line );
@@ -601,6 +1014,8 @@ bool Repositories::load( const char* fname_, unsigned int max_revs_, int& min_re
 
                 if ( line.substr( arg, colon - arg ) == "ignore" )
                     tag_ignore.insert( TAG_TEMP_BRANCH + line.substr( colon + 1 ) );
+                else if ( line.substr( arg, colon - arg ) == "finalize" )
+                    tag_finalize = atoi( line.substr( colon + 1 ).c_str() );
             }
             else if ( command == "commit" )
             {
@@ -680,23 +1095,305 @@ bool Repositories::load( const char* fname_, unsigned int max_revs_, int& min_re
             continue;
         }
 
-        Repository* rep = new Repository( line.substr( 0, min( equal, colon ) ), line.substr( equal + 1 ), max_revs_, cleanup_first );
+        Repository* rep = new Repository( line.substr( 0, min( equal, colon ) ), line.substr( equal + 1 ), sets_min_rev? min_rev_: 0, max_revs_, cleanup_first );
         if ( sets_min_rev )
             rep->mapCommit( min_rev_, line.substr( colon + 1, equal - colon - 1 ) );
 
         repos.push_back( rep );
+        routing.add( &rep->getRegex() );
 
         result = true;
     }
 
     branches.insert( "master" );
 
+    for ( set< string >::const_iterator it = selection.begin(); it != selection.end(); ++it )
+    {
+        if ( !find( *it ) )
+        {
+            Error::report( "Selected repository '" + *it + "' is not in the layout." );
+            result = false;
+        }
+    }
+
     return result;
 }
 
+void Repositories::setTarget( const std::string& target_dir_ )
+{
+    target_dir = target_dir_;
+}
+
+void Repositories::select( const std::string& names_ )
+{
+    size_t start = 0;
+    while ( start <= names_.size() )
+    {
+        size_t comma = names_.find( ',', start );
+        if ( comma == string::npos )
+            comma = names_.size();
+
+        if ( comma > start )
+            selection.insert( names_.substr( start, comma - start ) );
+
+        start = comma + 1;
+    }
+}
+
+bool Repositories::isSelected( const std::string& fname_ )
+{
+    return selection.empty() || get( fname_ ).isSelected();
+}
+
+bool Repositories::isSelectedDirectory( const std::string& dir_ )
+{
+    if ( selection.empty() )
+        return true;
+
+    Repository* repo = getForDirectory( dir_ );
+    return !repo || repo->isSelected();
+}
+
+void Repositories::setResumable()
+{
+    resumable = true;
+}
+
+/// Where Repositories::saveState() saves the state; every selection has its own.
+static string stateFile()
+{
+    string fname( target_dir + "/fast-export" );
+    for ( set< string >::const_iterator it = selection.begin(); it != selection.end(); ++it )
+        fname += ( it == selection.begin()? '.': ',' ) + *it;
+
+    return fname + ".state";
+}
+
+/// Identifies the file (and the version of its format).
+static const char state_magic[] = "fast-export state 1\n";
+
+bool Repositories::saveState( unsigned int rev_ )
+{
+    // the refs and the marks have to be written before we claim the revision
+    for ( Repos::iterator it = repos.begin(); it != repos.end(); ++it )
+        (*it)->checkpoint();
+
+    for ( Repos::iterator it = repos.begin(); it != repos.end(); ++it )
+    {
+        if ( !(*it)->sync() )
+        {
+            Error::report( "Cannot save the state, git fast-import for '" + (*it)->getName() + "' does not answer." );
+            return false;
+        }
+    }
+
+    const string fname( stateFile() );
+    const string tmp_fname( fname + ".tmp" );
+    ofstream out( tmp_fname.c_str(), ios_base::out | ios_base::trunc | ios_base::binary );
+
+    out.write( state_magic, sizeof( state_magic ) - 1 );
+    writeValue( out, rev_ );
+    writeValue( out, tables_max_revs );
+
+    writeValue< unsigned int >( out, branch_ids.size() );
+    for ( BranchIds::const_iterator it = branch_ids.begin(); it != branch_ids.end(); ++it )
+    {
+        writeString( out, it->first );
+        writeValue( out, it->second );
+    }
+
+    writeValue< unsigned int >( out, branches.size() );
+    for ( Branches::const_iterator it = branches.begin(); it != branches.end(); ++it )
+        writeString( out, *it );
+
+    writeValue< unsigned int >( out, pruned_branches.size() );
+    for ( set< string >::const_iterator it = pruned_branches.begin(); it != pruned_branches.end(); ++it )
+        writeString( out, *it );
+
+    writeValue< unsigned int >( out, tags.size() );
+    for ( Tags::const_iterator it = tags.begin(); it != tags.end(); ++it )
+    {
+        const Tag& tag = *(*it);
+        writeString( out, tag.tag_branch );
+        writeString( out, tag.committer.name );
+        writeString( out, tag.committer.email );
+        writeValue< long long >( out, tag.time.time );
+        writeValue( out, tag.time.timezone );
+        writeString( out, tag.log );
+        writeValue( out, tag.last_change );
+    }
+
+    writeValue< unsigned int >( out, repos.size() );
+    for ( Repos::const_iterator it = repos.begin(); it != repos.end(); ++it )
+    {
+        writeString( out, (*it)->getName() );
+        (*it)->saveState( out );
+    }
+
+    out.close();
+
+    // replace the old state only when the new one is complete
+    if ( !out || rename( tmp_fname.c_str(), fname.c_str() ) != 0 )
+    {
+        Error::report( "Cannot write the state to '" + fname + "'" );
+        return false;
+    }
+
+    return true;
+}
+
+/// Open the state, and read its header.
+static Repositories::StateStatus openState( ifstream& in_, unsigned int& rev_, unsigned int& max_revs_ )
+{
+    const string fname( stateFile() );
+    in_.open( fname.c_str(), ios_base::in | ios_base::binary );
+    if ( !in_ )
+        return Repositories::STATE_MISSING;
+
+    string magic( sizeof( state_magic ) - 1, '\0' );
+    in_.read( &magic[0], magic.size() );
+    if ( !in_ || magic != state_magic || !readValue( in_, rev_ ) || !readValue( in_, max_revs_ ) )
+    {
+        Error::report( "'" + fname + "' is not a valid state." );
+        return Repositories::STATE_INVALID;
+    }
+
+    return Repositories::STATE_VALID;
+}
+
+Repositories::StateStatus Repositories::stateMaxRevs( unsigned int& max_revs_ )
+{
+    ifstream in;
+    unsigned int rev;
+    return openState( in, rev, max_revs_ );
+}
+
+bool Repositories::loadState( unsigned int& rev_ )
+{
+    const string fname( stateFile() );
+    ifstream in;
+    unsigned int max_revs;
+    if ( openState( in, rev_, max_revs ) != STATE_VALID )
+        return false;
+
+    // the same tables, with the same room for the new revisions
+    if ( max_revs != tables_max_revs )
+    {
+        string message( "'" + fname + "' needs the tables for the revisions up to " );
+        appendNumber( message, max_revs );
+        Error::report( message );
+        return false;
+    }
+
+    unsigned int count;
+    bool ok = readValue( in, count );
+
+    branch_ids.clear();
+    for ( unsigned int i = 0; ok && i < count; ++i )
+    {
+        string branch;
+        BranchId id;
+        ok = readString( in, branch ) && readValue( in, id );
+        branch_ids[branch] = id;
+    }
+
+    branches.clear();
+    ok = ok && readValue( in, count );
+    for ( unsigned int i = 0; ok && i < count; ++i )
+    {
+        string branch;
+        ok = readString( in, branch );
+        branches.insert( branch );
+    }
+
+    pruned_branches.clear();
+    ok = ok && readValue( in, count );
+    for ( unsigned int i = 0; ok && i < count; ++i )
+    {
+        string branch;
+        ok = readString( in, branch );
+        pruned_branches.insert( branch );
+    }
+
+    tag_branches.clear();
+    pending_tags.clear();
+    while ( !tags.empty() )
+    {
+        delete tags.back();
+        tags.pop_back();
+    }
+    ok = ok && readValue( in, count );
+    for ( unsigned int i = 0; ok && i < count; ++i )
+    {
+        string tag_branch, name, email, log;
+        long long time;
+        int timezone;
+        unsigned int last_change;
+        ok = readString( in, tag_branch ) && readString( in, name ) && readString( in, email ) &&
+             readValue( in, time ) && readValue( in, timezone ) && readString( in, log ) &&
+             readValue( in, last_change );
+        if ( !ok )
+            break;
+
+        // the log is converted already
+        Tag* tag = new Tag( Committers::getAuthor( name + " <" + email + ">" ), tag_branch, Time( static_cast< time_t >( time ) ), string(), last_change );
+        tag->time.timezone = timezone;
+        tag->log = log;
+
+        tags.push_back( tag );
+        tag_branches[tag_branch] = tag;
+        if ( tag_finalize > 0 )
+            pending_tags.insert( make_pair( tag->last_change, tag ) );
+    }
+
+    ok = ok && readValue( in, count );
+    for ( unsigned int i = 0; ok && i < count; ++i )
+    {
+        string name;
+        ok = readString( in, name );
+        if ( !ok )
+            break;
+
+        Repository* repo = find( name );
+        if ( !repo )
+        {
+            Error::report( "Repository '" + name + "' from the state is not in the layout." );
+            return false;
+        }
+        ok = repo->loadState( in );
+    }
+
+    if ( !ok )
+    {
+        Error::report( "'" + fname + "' is truncated." );
+        return false;
+    }
+
+    return true;
+}
+
+void Repositories::setPrunedBranches( const std::set< std::string >& branches_ )
+{
+    pruned_branches = branches_;
+}
+
+const std::set< std::string >& Repositories::prunedBranches()
+{
+    return pruned_branches;
+}
+
+bool Repositories::canCopyTree()
+{
+    return !target_dir.empty();
+}
+
 void Repositories::close()
 {
-    // write tags for all the 'tag tracking' branches
+    routing.report( cerr, "Routing to repositories" );
+    Filter::report( cerr );
+
+    // write tags for all the 'tag tracking' branches (those written in
+    // writeIdleTags() already are skipped)
     for ( Repos::iterator it = repos.begin(); it != repos.end(); ++it )
         for ( Tags::const_iterator tag = tags.begin(); tag != tags.end(); ++tag )
             (*it)->createTag( *(*tag) );
@@ -707,6 +1404,8 @@ void Repositories::close()
         repos.pop_back();
     }
     
+    tag_branches.clear();
+    pending_tags.clear();
     while ( !tags.empty() )
     {
         delete tags.back();
@@ -714,18 +1413,93 @@ void Repositories::close()
     }
 }
 
-Repository& Repositories::get( const std::string& fname_ )
+void Repositories::checkpoint()
+{
+    for ( Repos::iterator it = repos.begin(); it != repos.end(); ++it )
+        (*it)->checkpoint();
+}
+
+bool Repositories::failed()
 {
-    Repository* repo = repos.front();
     for ( Repos::const_iterator it = repos.begin(); it != repos.end(); ++it )
+        if ( (*it)->failed() )
+            return true;
+
+    return false;
+}
+
+/// The tag_branch_ changed in the revision commit_id_.
+static void touchTag( const string& tag_branch_, unsigned int commit_id_ )
+{
+    if ( tag_finalize == 0 )
+        return;
+
+    TagBranches::iterator it = tag_branches.find( tag_branch_ );
+    if ( it == tag_branches.end() )
+        return;
+
+    Tag* tag = it->second;
+    pending_tags.erase( make_pair( tag->last_change, tag ) );
+    tag->last_change = commit_id_;
+    pending_tags.insert( make_pair( tag->last_change, tag ) );
+}
+
+/// Write the tags whose branches did not change for tag_finalize revisions.
+///
+/// So that Repositories::close() does not have to write them all at the
+/// end; if the branch changes later, the tag is written again.
+static void writeIdleTags( unsigned int commit_id_ )
+{
+    while ( !pending_tags.empty() && pending_tags.begin()->first + tag_finalize <= commit_id_ )
     {
-        repo = (*it);
-        if ( repo->matches( fname_ ) )
-            break;
+        Tag* tag = pending_tags.begin()->second;
+        pending_tags.erase( pending_tags.begin() );
+
+        for ( Repos::iterator it = repos.begin(); it != repos.end(); ++it )
+            (*it)->createTag( *tag );
     }
+}
+
+Repository& Repositories::get( const std::string& fname_ )
+{
+    pthread_mutex_lock( &routing_mutex );
+    int which = routing.firstMatch( fname_ );
+    pthread_mutex_unlock( &routing_mutex );
+
+    // the last one is the fallback
+    if ( which < 0 )
+        return *repos.back();
+
+    return *repos[which];
+}
+
+Repository* Repositories::getForDirectory( const std::string& dir_ )
+{
+    pthread_mutex_lock( &routing_mutex );
+    int which = routing.firstMatchDirectory( dir_ );
+    pthread_mutex_unlock( &routing_mutex );
+
+    // cannot tell
+    if ( which == -1 )
+        return NULL;
 
     // the last one is the fallback
-    return *repo;
+    if ( which < 0 )
+        return repos.back();
+
+    return repos[which];
+}
+
+bool Repositories::copyTree( unsigned int from_, const std::string& from_branch_, const std::string& fname_ )
+{
+    if ( !canCopyTree() )
+        return false;
+
+    bool result = true;
+    for ( Repos::iterator it = repos.begin(); it != repos.end(); ++it )
+        result = (*it)->copyTree( from_, from_branch_, fname_ ) && result;
+
+    return result;
 }
 
 void Repositories::commit( const Committer& committer_, const std::string& name_, unsigned int commit_id_, Time time_, const std::string& log_, const std::vector< int >& merges_ )
@@ -735,6 +1509,9 @@ void Repositories::commit( const Committer& committer_, const std::string& name_
 
     for ( Repos::iterator it = repos.begin(); it != repos.end(); ++it )
         (*it)->commit( committer_, name_, commit_id_, time_, log_, merges_ );
+
+    touchTag( name_, commit_id_ );
+    writeIdleTags( commit_id_ );
 }
 
 void Repositories::createBranchOrTag( bool is_branch_, unsigned int from_, const std::string& from_branch_,
@@ -746,7 +1523,43 @@ void Repositories::createBranchOrTag( bool is_branch_, unsigned int from_, const
     branches.insert( name_ );
 
     if ( !is_branch_ )
-        tags.push_back( new Tag( committer_, name_, time_, log_ ) );
+    {
+        Tag* tag = new Tag( committer_, name_, time_, log_, commit_id_ );
+        tags.push_back( tag );
+
+        TagBranches::iterator it = tag_branches.find( name_ );
+        if ( it != tag_branches.end() )
+            pending_tags.erase( make_pair( it->second->last_change, it->second ) );
+        tag_branches[name_] = tag;
+
+        if ( tag_finalize > 0 )
+            pending_tags.insert( make_pair( tag->last_change, tag ) );
+    }
+
+    writeIdleTags( commit_id_ );
+}
+
+void Repositories::deleteBranchOrTag( const std::string& name_ )
+{
+    branches.erase( name_ );
+
+    TagBranches::iterator branch = tag_branches.find( name_ );
+    if ( branch != tag_branches.end() )
+    {
+        pending_tags.erase( make_pair( branch->second->last_change, branch->second ) );
+        tag_branches.erase( branch );
+    }
+
+    for ( Tags::iterator it = tags.begin(); it != tags.end(); )
+    {
+        if ( (*it)->tag_branch == name_ )
+        {
+            delete (*it);
+            it = tags.erase( it );
+        }
+        else
+            ++it;
+    }
 }
 
 void Repositories::updateMercurialTag( const std::string& name_, int rev_,
@@ -11,13 +11,20 @@
 
 #include <string>
 #include <fstream>
+#include <iosfwd>
+#include <map>
+#include <set>
 #include <vector>
 
 #include <regex.h>
 
+#include "pathregex.hxx"
+
 #define TAG_TEMP_BRANCH "tag-branches/"
 
+class AsyncOutBuf;
 class Committer;
+class FastImport;
 
 struct Time
 {
@@ -49,39 +56,114 @@ struct Tag
     /// Log message.
     std::string log;
 
-    Tag( const Committer& committer_, const std::string& name_, Time time_, const std::string& log_ );
+    /// The last revision that created or changed the tag_branch.
+    unsigned int last_change;
+
+    Tag( const Committer& committer_, const std::string& name_, Time time_, const std::string& log_, unsigned int last_change_ );
+};
+
+typedef unsigned int BranchId;
+
+/// Blob written for a node-revision (file in a given revision), and its mode.
+struct NodeBlob
+{
+    unsigned int mark;
+    std::string mode;
+
+    NodeBlob() : mark( 0 ), mode() {}
+
+    NodeBlob( unsigned int mark_, const std::string& mode_ ) : mark( mark_ ), mode( mode_ ) {}
 };
 
-typedef unsigned short BranchId;
+/// Commit we have written to a branch.
+///
+/// More branches can get a commit in the same revision, so the mark is not
+/// the revision.
+struct BranchCommit
+{
+    unsigned int rev;
+    unsigned int mark;
+
+    BranchCommit() : rev( 0 ), mark( 0 ) {}
+
+    BranchCommit( unsigned int rev_, unsigned int mark_ ) : rev( rev_ ), mark( mark_ ) {}
+};
 
 class Repository
 {
     /// Remember what files we changed and how (deletes/modifications).
     std::string file_changes;
 
-    /// Counter for the files.
+    /// Counter for the files and the commits.
+    ///
+    /// Never reset, so that the blobs can be referenced from later commits
+    /// too.
     unsigned int mark;
 
+    /// Blobs we have already written.
+    ///
+    /// Key - content checksum + filter rule, content - mark of the blob.
+    std::map< std::string, unsigned int > blob_marks;
+
+    /// Node-revisions we have already written.
+    ///
+    /// Key - node-revision id + filter rule, content - mark & mode we used.
+    std::map< std::string, NodeBlob > node_blobs;
+
     /// Regex for matching the fnames.
-    regex_t regex_rule;
+    PathRegex regex_rule;
 
     /// Let's store to files.
     ///
     /// There can be a wrapping script that sets them up as named pipes that
     /// can feed the git fast-import(s).
-    std::ofstream out;
+    std::filebuf file;
+
+    /// Or we start the git fast-import ourselves, see Repositories::setTarget().
+    FastImport* fast_import;
+
+    /// Writes to file or to fast_import in its own thread, so that we do
+    /// not wait for a slow reader.
+    AsyncOutBuf* async_out;
+
+    /// The output - via async_out.
+    std::ostream out;
+
+    /// Do we write anything?  When not (see Repositories::select()), the
+    /// output has no buffer, and all the writes fail right away.
+    bool selected;
 
     /// We have to remember our commits
     ///
-    /// Index - commit number, content - branch id.
-    BranchId* commits;
+    /// Index - branch id, content - our commits to that branch, sorted by the revision.
+    std::vector< std::vector< BranchCommit > > branch_commits;
 
     /// Remember the chain of parents
-    std::string* parents;
+    ///
+    /// Index - commit number - first_rev, content - the commit number to use
+    /// as the parent when we want this one (-1 for none), see parentOf().
+    std::vector< int > parents;
+
+    /// Marks of our commits
+    ///
+    /// Index - commit number - first_rev, content - mark of the last commit
+    /// we wrote in that revision (0 for none), see commitRef().
+    std::vector< unsigned int > commit_marks;
+
+    /// Commits that are already in git, from ':commit map='.
+    ///
+    /// Key - commit number, content - sha1 (or 'ignore').
+    std::map< int, std::string > mapped_commits;
+
+    /// The first commit number we export, the tables start there.
+    unsigned int first_rev;
 
     /// Remember the tags we have already written.
     std::map< std::string, int > written_tags;
 
+    /// The 'tag tracking' branches we have written; removed again at the end.
+    std::set< std::string > tag_branch_refs;
+
     /// Max number of revisions.
     unsigned int max_revs;
 
@@ -94,18 +176,46 @@ class Repository
 
 public:
     /// The regex_ is here to decide if the file belongs to this repository.
-    Repository( const std::string& reponame_, const std::string& regex_, unsigned int max_revs_, bool cleanup_first_ );
+    Repository( const std::string& reponame_, const std::string& regex_, unsigned int first_rev_, unsigned int max_revs_, bool cleanup_first_ );
 
+    /// Removes the 'tag tracking' branches, and ends the stream with 'done'.
     ~Repository();
 
     /// Does the file belong to this repository (based on the regex we got?)
     bool matches( const std::string& fname_ ) const;
 
+    /// The regex deciding what files belong to this repository.
+    const PathRegex& getRegex() const { return regex_rule; }
+
+    /// Do we write this repository?  Nobody needs the content of its files otherwise.
+    bool isSelected() const { return selected; }
+
     /// The file should be marked for deletion.
     void deleteFile( const std::string& fname_ );
 
     /// The file should be marked for addition/modification.
-    std::ostream& modifyFile( const std::string& fname_, const char* mode_ );
+    ///
+    /// When blob_key_ is not empty, the blob is remembered for reuseBlob(),
+    /// when node_key_ is not empty, it is remembered for reuseNode().
+    std::ostream& modifyFile( const std::string& fname_, const char* mode_,
+            const std::string& blob_key_ = std::string(), const std::string& node_key_ = std::string() );
+
+    /// The file should be marked for addition/modification, with a blob we have already written.
+    ///
+    /// Returns false (and marks nothing) when we do not know the blob.
+    bool reuseBlob( const std::string& fname_, const char* mode_, const std::string& blob_key_, const std::string& node_key_ = std::string() );
+
+    /// The file should be marked for addition/modification, with the blob & mode of a node-revision we have already written.
+    ///
+    /// Returns false (and marks nothing) when we do not know the node-revision.
+    bool reuseNode( const std::string& fname_, const std::string& node_key_ );
+
+    /// Copy the directory fname_ (or file) as it was in from_branch_ at revision from_.
+    ///
+    /// Uses the 'ls' command of git fast-import to get the tree, so the
+    /// content of the source and the target must be the same.  Returns false
+    /// when we cannot do that because we are not talking to git fast-import.
+    bool copyTree( unsigned int from_, const std::string& from_branch_, const std::string& fname_ );
 
     /// Commit all the changes we did.
     void commit( const Committer& committer_, const std::string& name_, unsigned int commit_id_, Time time_, const std::string& log_, const std::vector< int >& merges_, bool force_ = false );
@@ -115,12 +225,31 @@ public:
             const Committer& committer_, const std::string& name_, unsigned int commit_id_, Time time_, const std::string& log_ );
 
     /// Create a tag (based on the 'tag tracking' branch).
+    ///
+    /// Does nothing when the tag already points to the last commit of the branch.
     void createTag( const Tag& tag_ );
 
     /// Create a tag (just output)
     void createTag(  const std::string& name_, int rev_, bool lookup_in_parents_,
             const Committer& committer_, Time time_, const std::string& log_ );
 
+    /// Make git fast-import write out what it has so far (the refs too).
+    void checkpoint();
+
+    /// Has the git fast-import we started failed?
+    bool failed() const;
+
+    /// Wait until git fast-import has processed everything we wrote so far.
+    ///
+    /// Returns false when we do not talk to git fast-import, or it does not answer.
+    bool sync();
+
+    /// Write what we need to continue the export later (see Repositories::saveState()).
+    void saveState( std::ostream& out_ ) const;
+
+    /// Read the state written by saveState().
+    bool loadState( std::istream& in_ );
+
     /// Map known commits betwenn Mercurial and Git
     void mapCommit( int rev_, const std::string& git_commit_ );
 
@@ -131,8 +260,25 @@ public:
     const std::string& getName() const { return name; }
 
 private:
-    /// Find the most recent commit to the specified branch smaller than the reference one.
-    unsigned int findCommit( unsigned int from_, const std::string& from_branch_ );
+    /// Add the 'M' line to the file changes.
+    void addModification( const std::string& fname_, const char* mode_, unsigned int mark_, const std::string& node_key_ );
+
+    /// Is the commit number in our tables?
+    bool inTables( int commit_id_ ) const { return commit_id_ >= static_cast< int >( first_rev ) && commit_id_ - first_rev < parents.size(); }
+
+    /// The commit (ours or mapped) to use as the parent when we want commit_id_, or -1.
+    int parentOf( int commit_id_ ) const;
+
+    /// How to refer to the commit from parentOf() in 'from' or 'merge'.
+    std::string commitRef( int commit_id_ ) const;
+
+    /// Find the most recent commit to the specified branch not newer than the reference one.
+    ///
+    /// Its rev is 0 when there is none.
+    BranchCommit findCommit( unsigned int from_, const std::string& from_branch_ );
+
+    /// Write the tag pointing to from_ (mark or sha1).
+    void writeTag( const std::string& name_, const std::string& from_, const Committer& committer_, Time time_, const std::string& log_ );
 };
 
 namespace Repositories
@@ -140,17 +286,94 @@ namespace Repositories
     /// Load the repositories layout from the config file.
     bool load( const char* fname_, unsigned int max_revs_, int& min_rev_, std::string& trunk_base_, std::string& trunk_, std::string& branches_, std::string& tags_ );
 
+    /// Start git fast-import for every repository in target_dir_/<name>, instead of writing <name>.dump.
+    ///
+    /// Has to be called before load().
+    void setTarget( const std::string& target_dir_ );
+
+    /// Write only the repositories in the comma separated list names_; the
+    /// others still follow the branches and tags, but get no content.
+    ///
+    /// Has to be called before load().
+    void select( const std::string& names_ );
+
+    /// Does the file belong to a repository we write?
+    bool isSelected( const std::string& fname_ );
+
+    /// Can a file in the directory dir_ belong to a repository we write?
+    bool isSelectedDirectory( const std::string& dir_ );
+
+    /// Can we use copyTree()?
+    bool canCopyTree();
+
     /// Close all the repositories.
     void close();
 
+    /// Make all the git fast-imports write out what they have so far.
+    void checkpoint();
+
+    /// Let every git fast-import keep its marks in DIR/<name>.marks, so that
+    /// an export can be continued from the state saved by saveState().
+    ///
+    /// Has to be called after setTarget(), and before load().
+    void setResumable();
+
+    /// Checkpoint all the git fast-imports, wait for them, and then save our
+    /// state after the revision rev_ to DIR/fast-export.state.
+    bool saveState( unsigned int rev_ );
+
+    /// What stateMaxRevs() found.
+    enum StateStatus {
+        STATE_MISSING, ///< No state saved yet
+        STATE_VALID,   ///< max_revs_ is valid
+        STATE_INVALID, ///< There is a state, but we cannot read it
+    };
+
+    /// The max_revs_ that load() has to get to continue from the saved state.
+    StateStatus stateMaxRevs( unsigned int& max_revs_ );
+
+    /// Load the state saved by saveState(); rev_ is the last revision it covers.
+    ///
+    /// Has to be called after load(); returns false when there is no state.
+    bool loadState( unsigned int& rev_ );
+
+    /// The branches that are not exported at all (--prune-dead-branches).
+    ///
+    /// Kept in the state: their history is not in git, so they have to stay
+    /// pruned when the export continues.
+    void setPrunedBranches( const std::set< std::string >& branches_ );
+
+    /// The branches from setPrunedBranches(), or from the loaded state.
+    const std::set< std::string >& prunedBranches();
+
+    /// Has any of the git fast-imports we started failed?
+    ///
+    /// There is no point in continuing then.
+    bool failed();
+
     /// Get the right repository according to the filename.
     Repository& get( const std::string& fname_ );
 
+    /// Get the repository where all the files from the directory dir_ belong.
+    ///
+    /// Returns NULL when they can belong to more repositories (or we cannot tell).
+    Repository* getForDirectory( const std::string& dir_ );
+
     /// The file should be marked for deletion.
     inline void deleteFile( const std::string& fname_ ) { get( fname_ ).deleteFile( fname_ ); }
 
     /// The file should be marked for addition/modification.
-    inline std::ostream& modifyFile( const std::string& fname_, const char* mode_ ) { return get( fname_ ).modifyFile( fname_, mode_ ); }
+    inline std::ostream& modifyFile( const std::string& fname_, const char* mode_,
+            const std::string& blob_key_ = std::string(), const std::string& node_key_ = std::string() ) { return get( fname_ ).modifyFile( fname_, mode_, blob_key_, node_key_ ); }
+
+    /// The file should be marked for addition/modification, with a blob we have already written.
+    inline bool reuseBlob( const std::string& fname_, const char* mode_, const std::string& blob_key_, const std::string& node_key_ = std::string() ) { return get( fname_ ).reuseBlob( fname_, mode_, blob_key_, node_key_ ); }
+
+    /// The file should be marked for addition/modification, with the blob of a node-revision we have already written.
+    inline bool reuseNode( const std::string& fname_, const std::string& node_key_ ) { return get( fname_ ).reuseNode( fname_, node_key_ ); }
+
+    /// Copy the directory fname_ as it was in from_branch_ at revision from_, in all the repositories.
+    bool copyTree( unsigned int from_, const std::string& from_branch_, const std::string& fname_ );
 
     /// Commit to the all repositories that have some changes.
     void commit( const Committer& committer_, const std::string& name_, unsigned int commit_id_, Time time_, const std::string& log_, const std::vector< int >& merges_ = std::vector< int >() );
@@ -159,6 +382,12 @@ namespace Repositories
     void createBranchOrTag( bool is_branch_, unsigned int from_, const std::string& from_branch_,
             const Committer& committer_, const std::string& name_, unsigned int commit_id_, Time time_, const std::string& log_ );
 
+    /// Forget a branch or a tag that was deleted as a whole.
+    ///
+    /// The commits that were already written stay as they are, the branch
+    /// just does not get any new ones, and the tag is not created.
+    void deleteBranchOrTag( const std::string& name_ );
+
     /// Update the tags according to the .hgtags file
     void updateMercurialTag( const std::string& name_, int rev_,
             const Committer& committer_, Time time_, const std::string& log_ );
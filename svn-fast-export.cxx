@@ -11,16 +11,22 @@
 
 #define _XOPEN_SOURCE
 #include <unistd.h>
+#include <signal.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <time.h>
 
+#include <deque>
 #include <ostream>
 
 #include "committers.hxx"
 #include "error.hxx"
 #include "filter.hxx"
+#include "plan.hxx"
+#include "prefetch.hxx"
 #include "repository.hxx"
+#include "treewalk.hxx"
 
 #ifndef PATH_MAX
 #define PATH_MAX 4096
@@ -46,6 +52,42 @@ static string trunk = trunk_base + "/";
 static string branches = "/branches/";
 static string tags = "/tags/";
 
+/// The first revision we export, nothing older is known to the output.
+static svn_revnum_t first_rev = 1;
+
+/// Bigger files that need filtering are read twice (to count the length of the result) instead of being kept in memory.
+static const svn_filesize_t max_filtered_in_memory = 4*1024*1024;
+
+/// Every this many revisions, git fast-import writes out what it has (--checkpoint).
+static svn_revnum_t checkpoint_revs = 10000;
+
+/// Save the state at every checkpoint, and continue from it (--resume).
+static bool resume = false;
+
+/// When > 0, look for new revisions every this many seconds (--follow).
+static unsigned int follow_seconds = 0;
+
+/// Set by SIGINT / SIGTERM when following.
+static volatile sig_atomic_t stop_following = 0;
+
+/// Room in the tables for the revisions that come after the export started (--follow, --resume).
+static const svn_revnum_t reserve_revs = 100000;
+
+/// Number of threads reading the next revisions in advance (--prefetch).
+static unsigned int prefetch_threads = 0;
+
+/// Reads the next revisions in advance (when prefetch_threads > 0).
+static Prefetcher* prefetcher = NULL;
+
+/// Where to keep the plan, for the next runs (--plan).
+static const char* plan_fname = NULL;
+
+/// Skip the branches that were deleted without anything copied from them (--prune-dead-branches).
+static bool prune_dead_branches = false;
+
+/// The branches and the copies between them (with prune_dead_branches).
+static Plan* plan = NULL;
+
 static bool split_into_branch_filename( const char* path_, string& branch_, string& fname_ );
 
 static Time get_epoch( const svn_string_t* svndate )
@@ -61,11 +103,35 @@ static Time get_epoch( const svn_string_t* svndate )
     return Time( mktime(&tm) );
 }
 
-static int dump_blob( svn_fs_root_t *root, char *full_path, const string &target_name, apr_pool_t *pool )
+static int dump_blob( svn_fs_root_t *root, const char *full_path, const string &target_name, apr_pool_t *pool )
 {
+    // goes to a repository we do not write
+    if ( !Repositories::isSelected( target_name ) )
+        return 0;
+
     // create an own pool to avoid overflow of open streams
     apr_pool_t *subpool = svn_pool_create( pool );
 
+    Filter filter( target_name );
+
+    // have we written this node-revision (with the same filter) already?
+    // typically when copying a hierarchy
+    const svn_fs_id_t *node_id;
+    SVN_ERR( svn_fs_node_id( &node_id, root, full_path, subpool ) );
+
+    svn_string_t *node_id_str = svn_fs_unparse_id( node_id, subpool );
+
+    char rule[20];
+    snprintf( rule, sizeof( rule ), ":%d", filter.getRule() );
+
+    string node_key( string( node_id_str->data, node_id_str->len ) + rule );
+
+    if ( Repositories::reuseNode( target_name, node_key ) )
+    {
+        svn_pool_destroy( subpool );
+        return 0;
+    }
+
     // prepare the stream
     svn_string_t *propvalue;
     SVN_ERR( svn_fs_node_prop( &propvalue, root, full_path, "svn:executable", subpool ) );
@@ -77,7 +143,6 @@ static int dump_blob( svn_fs_root_t *root, char *full_path, const string &target
     if ( propvalue )
         Error::report( "Got a symlink; we cannot handle symlinks now." );
 
-    Filter filter( target_name );
     FilePermission perm = filter.getPermission();
     switch ( perm )
     {
@@ -86,62 +151,137 @@ static int dump_blob( svn_fs_root_t *root, char *full_path, const string &target
         default:                break;
     }
 
-    ostream& out = Repositories::modifyFile( target_name, mode );
+    // have we written the same content (with the same filter) already?
+    svn_checksum_t *checksum;
+    SVN_ERR( svn_fs_file_checksum( &checksum, svn_checksum_md5, root, full_path, TRUE, subpool ) );
+
+    svn_filesize_t length;
+    SVN_ERR( svn_fs_file_length( &length, root, full_path, subpool ) );
+
+    char blob_key[100];
+    snprintf( blob_key, sizeof( blob_key ), "%s:%lld%s",
+            svn_checksum_to_cstring( checksum, subpool ), static_cast< long long >( length ), rule );
+
+    if ( Repositories::reuseBlob( target_name, mode, blob_key, node_key ) )
+    {
+        svn_pool_destroy( subpool );
+        return 0;
+    }
+
+    ostream& out = Repositories::modifyFile( target_name, mode, blob_key, node_key );
+
+    // maybe we have it in memory already (maybe even filtered)
+    string content;
+    bool filtered;
+    if ( prefetcher && prefetcher->take( svn_fs_revision_root_revision( root ), full_path, filter.getRule(), content, filtered ) )
+    {
+        if ( filtered )
+            Filter::writeFiltered( out, content );
+        else if ( !filter.changesContent() )
+        {
+            filter.writeHeader( out, content.size() );
+            filter.writeData( out, content.data(), content.size() );
+            filter.writeFooter( out );
+        }
+        else
+        {
+            filter.addData( content );
+            filter.write( out );
+        }
+
+        svn_pool_destroy( subpool );
+        return 0;
+    }
 
     // dump the content of the file
     svn_stream_t   *stream;
     SVN_ERR( svn_fs_file_contents( &stream, root, full_path, subpool ) );
 
-    const size_t buffer_size = 8192;
-    char buffer[buffer_size];
+    const apr_size_t buffer_size = 65536;
+    char *buffer = static_cast< char* >( apr_palloc( subpool, buffer_size ) );
 
     apr_size_t len;
-    do {
-        len = buffer_size;
-        SVN_ERR( svn_stream_read( stream, buffer, &len ) );
-        filter.addData( buffer, len );
-    } while ( len > 0 );
-
-    filter.write( out );
+    if ( !filter.changesContent() )
+    {
+        // we know the length, stream it directly
+        filter.writeHeader( out, length );
+        do {
+            len = buffer_size;
+            SVN_ERR( svn_stream_read( stream, buffer, &len ) );
+            filter.writeData( out, buffer, len );
+        } while ( len > 0 );
+        filter.writeFooter( out );
+    }
+    else if ( length <= max_filtered_in_memory )
+    {
+        do {
+            len = buffer_size;
+            SVN_ERR( svn_stream_read( stream, buffer, &len ) );
+            filter.addData( buffer, len );
+        } while ( len > 0 );
+        filter.write( out );
+    }
+    else
+    {
+        // too big to keep in memory; count the length of the result first,
+        // and then read it once more
+        do {
+            len = buffer_size;
+            SVN_ERR( svn_stream_read( stream, buffer, &len ) );
+            filter.count( buffer, len );
+        } while ( len > 0 );
+        filter.writeHeader( out );
+
+        SVN_ERR( svn_fs_file_contents( &stream, root, full_path, subpool ) );
+        do {
+            len = buffer_size;
+            SVN_ERR( svn_stream_read( stream, buffer, &len ) );
+            filter.writeData( out, buffer, len );
+        } while ( len > 0 );
+        filter.writeFooter( out );
+    }
 
     svn_pool_destroy( subpool );
 
     return 0;
 }
 
-static int delete_hierarchy( svn_fs_root_t *fs_root, char *path, apr_pool_t *pool )
+static int delete_hierarchy( svn_fs_root_t *fs_root, const char *path, apr_pool_t *pool )
 {
     // we have to crawl the hierarchy and delete the files one by one because
     // the regexp deciding to what repository does the file belong can be just
-    // anything
-    svn_boolean_t is_dir;
-    SVN_ERR( svn_fs_is_dir( &is_dir, fs_root, path, pool ) );
-
-    if ( is_dir )
+    // anything - unless we can prove that the entire directory goes to one
+    // repository
+    TreeWalk walk( fs_root, path, pool );
+    while ( true )
     {
-        apr_hash_t *entries;
-        SVN_ERR( svn_fs_dir_entries( &entries, fs_root, path, pool ) );
+        bool found;
+        SVN_ERR( walk.next( found ) );
+        if ( !found )
+            break;
 
-        for ( apr_hash_index_t *i = apr_hash_first( pool, entries ); i; i = apr_hash_next( i ) )
-        {
-            const void *key;
-            void       *val;
-            apr_hash_this( i, &key, NULL, &val );
-
-            delete_hierarchy( fs_root, (char *)( string( path ) + '/' + (char *)key ).c_str(), pool );
-        }
-    }
-    else
-    {
+        // we don't have to care about the branch name, it cannot change
         string this_branch, fname;
+        if ( !split_into_branch_filename( walk.path().c_str(), this_branch, fname ) )
+            continue;
 
-        // we don't have to care about the branch name, it cannot change
-        if ( split_into_branch_filename( path, this_branch, fname ) )
+        if ( !walk.isDir() )
             Repositories::deleteFile( fname );
+        else if ( !fname.empty() )
+        {
+            Repository* repo = Repositories::getForDirectory( fname );
+            if ( repo )
+            {
+                repo->deleteFile( fname );
+                walk.skipChildren();
+            }
+        }
     }
+
+    return 0;
 }
 
-static int delete_hierarchy_rev( svn_fs_t *fs, svn_revnum_t rev, char *path, apr_pool_t *pool )
+static int delete_hierarchy_rev( svn_fs_t *fs, svn_revnum_t rev, const char *path, apr_pool_t *pool )
 {
     svn_fs_root_t *fs_root;
 
@@ -151,38 +291,93 @@ static int delete_hierarchy_rev( svn_fs_t *fs, svn_revnum_t rev, char *path, apr
     return delete_hierarchy( fs_root, path, pool );
 }
 
-static int dump_hierarchy( svn_fs_root_t *fs_root, char *path, int skip,
-        const string &prefix, apr_pool_t *pool )
+static int dump_hierarchy( svn_fs_root_t *fs_root, const char *path, const string &prefix, apr_pool_t *pool )
 {
-    svn_boolean_t is_dir;
-    SVN_ERR( svn_fs_is_dir( &is_dir, fs_root, path, pool ) );
+    const svn_revnum_t rev = svn_fs_revision_root_revision( fs_root );
+    const size_t skip = strlen( path );
 
-    if ( is_dir )
-    {
-        apr_hash_t *entries;
-        SVN_ERR( svn_fs_dir_entries( &entries, fs_root, path, pool ) );
+    // the files are output in the order of the walk, but the prefetcher
+    // reads the next ones meanwhile
+    const size_t ahead = prefetcher? prefetcher->filesAhead(): 1;
+    deque< string > files;
 
-        for ( apr_hash_index_t *i = apr_hash_first( pool, entries ); i; i = apr_hash_next( i ) )
+    TreeWalk walk( fs_root, path, pool );
+    bool found = true;
+    while ( true )
+    {
+        while ( found && files.size() < ahead )
         {
-            const void *key;
-            void       *val;
-            apr_hash_this( i, &key, NULL, &val );
+            SVN_ERR( walk.next( found ) );
+            if ( !found )
+                break;
 
-            dump_hierarchy( fs_root, (char *)( string( path ) + '/' + (char *)key ).c_str(), skip, prefix, pool );
+            const string target( prefix + walk.path().substr( skip ) );
+            if ( walk.isDir() )
+            {
+                // everything there goes to a repository we do not write
+                if ( !target.empty() && !Repositories::isSelectedDirectory( target ) )
+                    walk.skipChildren();
+            }
+            else if ( Repositories::isSelected( target ) )
+            {
+                files.push_back( walk.path() );
+                if ( prefetcher )
+                    prefetcher->request( rev, walk.path(), target );
+            }
         }
+
+        if ( files.empty() )
+            break;
+
+        const string& file = files.front();
+        dump_blob( fs_root, file.c_str(), prefix + file.substr( skip ), pool );
+
+        // not taken when we had the node or the blob already
+        if ( prefetcher )
+            prefetcher->forget( rev, file );
+
+        files.pop_front();
     }
-    else
-        dump_blob( fs_root, path, prefix + string( path + skip ), pool );
 
     return 0;
 }
 
-static int copy_hierarchy( svn_fs_t *fs, svn_revnum_t rev, char *path_from, const string &path_to, apr_pool_t *pool )
+static int copy_hierarchy( svn_fs_t *fs, svn_revnum_t rev, const char *path_from, const string &path_to, apr_pool_t *pool )
 {
     svn_fs_root_t *fs_root;
     SVN_ERR( svn_fs_revision_root( &fs_root, fs, rev, pool ) );
 
-    return dump_hierarchy( fs_root, path_from, strlen( path_from ), path_to, pool );
+    return dump_hierarchy( fs_root, path_from, path_to, pool );
+}
+
+/// Did the properties that affect the mode of the file change in rev?
+static int mode_changed( svn_fs_t *fs, svn_fs_root_t *fs_root, svn_revnum_t rev, const char *path, bool &changed, apr_pool_t *pool )
+{
+    changed = true;
+
+    svn_fs_root_t *prev_root;
+    SVN_ERR( svn_fs_revision_root( &prev_root, fs, rev - 1, pool ) );
+
+    // eg. modified in a directory that was copied in the same revision
+    svn_node_kind_t kind;
+    SVN_ERR( svn_fs_check_path( &kind, prev_root, path, pool ) );
+    if ( kind != svn_node_file )
+        return 0;
+
+    const char* mode_props[] = { "svn:executable", "svn:special" };
+    for ( size_t i = 0; i < sizeof( mode_props ) / sizeof( mode_props[0] ); ++i )
+    {
+        svn_string_t *now, *before;
+        SVN_ERR( svn_fs_node_prop( &now, fs_root, path, mode_props[i], pool ) );
+        SVN_ERR( svn_fs_node_prop( &before, prev_root, path, mode_props[i], pool ) );
+        if ( ( now == NULL ) != ( before == NULL ) )
+            return 0;
+    }
+
+    // the permissions from the filter depend just on the path
+    changed = false;
+
+    return 0;
 }
 
 static bool is_trunk( const char* path_ )
@@ -258,7 +453,7 @@ int export_revision(svn_revnum_t rev, svn_fs_t *fs, apr_pool_t *pool)
     svn_string_t         *author, *committer, *svndate, *svnlog;
     svn_boolean_t        is_dir;
     svn_fs_root_t        *fs_root;
-    svn_fs_path_change_t *change;
+    svn_fs_path_change2_t *change;
 
     fprintf( stderr, "Exporting revision %ld... ", rev );
 
@@ -269,7 +464,7 @@ int export_revision(svn_revnum_t rev, svn_fs_t *fs, apr_pool_t *pool)
     }
 
     SVN_ERR(svn_fs_revision_root(&fs_root, fs, rev, pool));
-    SVN_ERR(svn_fs_paths_changed(&changes, fs_root, pool));
+    SVN_ERR(svn_fs_paths_changed2(&changes, fs_root, pool));
     SVN_ERR(svn_fs_revision_proplist(&props, fs, rev, pool));
 
     revpool = svn_pool_create(pool);
@@ -286,11 +481,12 @@ int export_revision(svn_revnum_t rev, svn_fs_t *fs, apr_pool_t *pool)
     bool no_changes = true;
     bool debug_once = true;
     bool tagged_or_branched = false;
+    bool branch_deleted = false;
     for (i = apr_hash_first(pool, changes); i; i = apr_hash_next(i)) {
         svn_pool_clear(revpool);
         apr_hash_this(i, &key, NULL, &val);
         path = (char *)key;
-        change = (svn_fs_path_change_t *)val;
+        change = (svn_fs_path_change2_t *)val;
 
         if ( debug_once )
         {
@@ -308,12 +504,26 @@ int export_revision(svn_revnum_t rev, svn_fs_t *fs, apr_pool_t *pool)
         if ( !split_into_branch_filename( path, this_branch, fname ) )
             continue;
 
+        // nothing from the dead branches gets anywhere (--prune-dead-branches)
+        if ( plan && plan->isDead( this_branch ) )
+            continue;
+
         // ignore the tags we do not want
         if ( is_tag( path ) && Repositories::ignoreTag( this_branch ) )
             continue;
 
         SVN_ERR(svn_fs_is_dir(&is_dir, fs_root, path, revpool));
 
+        // only the properties changed (svn:mergeinfo, svn:keywords, ...) -
+        // nothing to do unless it changes the mode
+        if ( !is_dir && change->change_kind == svn_fs_path_change_modify && !change->text_mod )
+        {
+            bool changed;
+            mode_changed( fs, fs_root, rev, path, changed, revpool );
+            if ( !changed )
+                continue;
+        }
+
         // detect creation of branch/tag
         if ( is_dir && change->change_kind == svn_fs_path_change_add )
         {
@@ -334,6 +544,10 @@ int export_revision(svn_revnum_t rev, svn_fs_t *fs, apr_pool_t *pool)
                          split_into_branch_filename( path_from, from_branch, from_fname ) &&
                          from_fname.empty() )
                     {
+                        // after the planned revisions
+                        if ( plan && plan->isDead( from_branch ) )
+                            Error::report( "Branch '" + this_branch + "' is created from the pruned branch '" + from_branch + "', export again without --prune-dead-branches." );
+
                         Repositories::createBranchOrTag( branching,
                                 rev_from, from_branch,
                                 Committers::getAuthor( author->data ),
@@ -348,6 +562,16 @@ int export_revision(svn_revnum_t rev, svn_fs_t *fs, apr_pool_t *pool)
             }
         }
 
+        // deletion of a whole branch/tag - no need to delete the files one
+        // by one, the commits we already have stay as they are
+        if ( change->change_kind == svn_fs_path_change_delete && fname.empty() &&
+             ( is_branch( path ) || is_tag( path ) ) )
+        {
+            Repositories::deleteBranchOrTag( this_branch );
+            branch_deleted = true;
+            continue;
+        }
+
         // sanity check
         if ( branch.empty() )
             branch = this_branch;
@@ -365,7 +589,7 @@ int export_revision(svn_revnum_t rev, svn_fs_t *fs, apr_pool_t *pool)
 
         // add/remove/move the files
         if ( change->change_kind == svn_fs_path_change_delete )
-            delete_hierarchy_rev( fs, rev, (char *)path, revpool );
+            delete_hierarchy_rev( fs, rev, path, revpool );
         else if ( is_dir )
         {
             svn_revnum_t rev_from;
@@ -375,17 +599,28 @@ int export_revision(svn_revnum_t rev, svn_fs_t *fs, apr_pool_t *pool)
             if ( path_from == NULL )
                 continue;
 
-            copy_hierarchy( fs, rev_from, (char *)path_from, fname, revpool );
+            // when the content stays in the same place (just in another
+            // branch), the tree looks the same, and git fast-import can
+            // copy it for us
+            string from_branch, from_fname;
+            if ( rev_from < first_rev ||
+                 !split_into_branch_filename( path_from, from_branch, from_fname ) ||
+                 ( plan && plan->isDead( from_branch ) ) ||
+                 from_fname.empty() || from_fname != fname ||
+                 !Repositories::copyTree( rev_from, from_branch, fname ) )
+            {
+                copy_hierarchy( fs, rev_from, path_from, fname, revpool );
+            }
         }
         else
-            dump_blob( fs_root, (char *)path, fname, revpool );
+            dump_blob( fs_root, path, fname, revpool );
 
         no_changes = false;
     }
 
     if ( no_changes || branch.empty() )
     {
-        fprintf( stderr, "%s.\n", tagged_or_branched? "created": "skipping" );
+        fprintf( stderr, "%s.\n", tagged_or_branched? "created": ( branch_deleted? "deleted": "skipping" ) );
         svn_pool_destroy( revpool );
         return 0;
     }
@@ -409,12 +644,174 @@ int export_revision(svn_revnum_t rev, svn_fs_t *fs, apr_pool_t *pool)
     return 0;
 }
 
+/// Name of the file in the output, for the Prefetcher; runs in its threads.
+static bool target_name( const char* path_, string& fname_ )
+{
+    string branch;
+    return split_into_branch_filename( path_, branch, fname_ ) && !fname_.empty() &&
+           !( plan && plan->isDead( branch ) ) && Repositories::isSelected( fname_ );
+}
+
+/// Note the branches created or deleted in rev, and the copies from them;
+/// looks only at the changed paths.
+static int plan_revision( svn_revnum_t rev, svn_fs_t *fs, apr_pool_t *pool )
+{
+    if ( Repositories::ignoreRevision( rev ) )
+        return 0;
+
+    svn_fs_root_t *fs_root;
+    apr_hash_t *changes;
+    SVN_ERR(svn_fs_revision_root(&fs_root, fs, rev, pool));
+    SVN_ERR(svn_fs_paths_changed2(&changes, fs_root, pool));
+
+    for (apr_hash_index_t *i = apr_hash_first(pool, changes); i; i = apr_hash_next(i)) {
+        const void *key;
+        void *val;
+        apr_hash_this(i, &key, NULL, &val);
+        const char *path = static_cast< const char* >( key );
+        const svn_fs_path_change2_t *change = static_cast< const svn_fs_path_change2_t* >( val );
+
+        // the same paths as export_revision() skips
+        if ( path[0] != '/' || strchr( path + 1, '/' ) == NULL )
+            continue;
+
+        string branch, fname;
+        if ( !split_into_branch_filename( path, branch, fname ) )
+            continue;
+
+        if ( is_tag( path ) && Repositories::ignoreTag( branch ) )
+            continue;
+
+        if ( change->change_kind == svn_fs_path_change_delete )
+        {
+            if ( fname.empty() && is_branch( path ) )
+                plan->branchDeleted( branch );
+            continue;
+        }
+
+        if ( change->change_kind != svn_fs_path_change_add && change->change_kind != svn_fs_path_change_replace )
+            continue;
+
+        if ( fname.empty() && is_branch( path ) )
+            plan->branchCreated( branch );
+
+        svn_revnum_t rev_from = change->copyfrom_rev;
+        const char *path_from = change->copyfrom_path;
+        if ( !change->copyfrom_known )
+            SVN_ERR(svn_fs_copied_from(&rev_from, &path_from, fs_root, path, pool));
+
+        string from_branch, from_fname;
+        if ( path_from != NULL && is_branch( path_from ) &&
+             split_into_branch_filename( path_from, from_branch, from_fname ) )
+            plan->copied( from_branch, branch );
+    }
+
+    return 0;
+}
+
+/// Plan the revisions after plan->last() up to to_; false when some of them failed.
+static bool plan_revisions( svn_fs_t *fs, svn_revnum_t to_, apr_pool_t *pool )
+{
+    apr_pool_t *subpool = svn_pool_create(pool);
+    bool result = true;
+
+    for (svn_revnum_t rev = plan->last() + 1; rev <= to_; rev++) {
+        svn_pool_clear(subpool);
+
+        if ( plan_revision(rev, fs, subpool) != 0 )
+            result = false;
+        plan->add();
+    }
+
+    svn_pool_destroy(subpool);
+
+    return result;
+}
+
+/// Export the revisions from_..to_; returns false when we have to stop.
+static bool export_revisions( svn_fs_t *fs, svn_revnum_t from_, svn_revnum_t to_, apr_pool_t *pool )
+{
+    apr_pool_t *subpool = svn_pool_create(pool);
+    bool result = true;
+
+    for (svn_revnum_t rev = from_; rev <= to_; rev++) {
+        svn_pool_clear(subpool);
+        if ( prefetcher )
+            prefetcher->advance( rev );
+        export_revision(rev, fs, subpool);
+
+        if ( Repositories::failed() )
+        {
+            Error::report( "Stopping the export." );
+            result = false;
+            break;
+        }
+
+        const bool checkpoint = ( ( rev - first_rev + 1 ) % checkpoint_revs == 0 );
+        if ( checkpoint )
+        {
+            if ( resume )
+                Repositories::saveState( rev );
+            else
+                Repositories::checkpoint();
+        }
+
+        // SIGINT / SIGTERM when following, do not wait for the end of a long
+        // export; --resume continues after this revision
+        if ( stop_following )
+        {
+            if ( resume && !checkpoint )
+                Repositories::saveState( rev );
+            result = false;
+            break;
+        }
+    }
+
+    svn_pool_destroy(subpool);
+
+    return result;
+}
+
+/// The last revision that is complete, to rev_.
+///
+/// svnsync commits the revision first, and copies svn:author, svn:date and
+/// svn:log to it only then; on a mirror, take only what it has finished.
+static int last_complete_rev( svn_fs_t *fs, svn_revnum_t &rev_, apr_pool_t *pool )
+{
+    SVN_ERR(svn_fs_youngest_rev(&rev_, fs, pool));
+
+    svn_string_t *merged;
+    SVN_ERR(svn_fs_revision_prop(&merged, fs, 0, "svn:sync-last-merged-rev", pool));
+    if ( merged && merged->data )
+    {
+        const svn_revnum_t last_merged = atol( merged->data );
+        if ( last_merged < rev_ )
+            rev_ = last_merged;
+    }
+
+    return 0;
+}
+
+/// Lower rev_ to the last revision that has room in the tables; false when it has to.
+static bool fit_into_tables( svn_revnum_t& rev_, svn_revnum_t table_revs_ )
+{
+    if ( rev_ <= table_revs_ )
+        return true;
+
+    char message[100];
+    snprintf( message, sizeof( message ), "No room for the revisions after %ld, they need a new export.", table_revs_ );
+    Error::report( message );
+
+    rev_ = table_revs_;
+    return false;
+}
+
 int crawl_revisions( char *repos_path, const char* repos_config )
 {
-    apr_pool_t   *pool, *subpool;
+    apr_pool_t   *pool;
     svn_fs_t     *fs;
     svn_repos_t  *repos;
-    svn_revnum_t youngest_rev, min_rev, max_rev, rev;
+    svn_revnum_t youngest_rev, min_rev, max_rev, table_revs;
 
     pool = svn_pool_create(NULL);
 
@@ -425,10 +822,26 @@ int crawl_revisions( char *repos_path, const char* repos_config )
     SVN_ERR(svn_fs_youngest_rev(&youngest_rev, fs, pool));
 
     min_rev = 1;
-    max_rev = youngest_rev;
+
+    // the tables end at the last revision we can export, leave room for
+    // the revisions that come later
+    table_revs = youngest_rev;
+    unsigned int saved_table_revs;
+    const Repositories::StateStatus state = resume? Repositories::stateMaxRevs( saved_table_revs ): Repositories::STATE_MISSING;
+    const bool has_state = ( state == Repositories::STATE_VALID );
+    if ( state == Repositories::STATE_INVALID )
+        return 1; // do not start over into the same git repositories
+    else if ( has_state )
+        table_revs = saved_table_revs;
+    else if ( resume || follow_seconds > 0 )
+        table_revs += reserve_revs;
+
+    if ( last_complete_rev( fs, max_rev, pool ) != 0 )
+        return 1;
+    bool ok = fit_into_tables( max_rev, table_revs );
 
     int dummy = -1;
-    if ( !Repositories::load( repos_config, max_rev, dummy, trunk_base, trunk, branches, tags ) )
+    if ( !Repositories::load( repos_config, table_revs, dummy, trunk_base, trunk, branches, tags ) )
     {
         Error::report( "Must have at least one valid repository definition." );
         return 1;
@@ -436,32 +849,195 @@ int crawl_revisions( char *repos_path, const char* repos_config )
     if ( dummy != -1 )
         min_rev = dummy;
 
-    subpool = svn_pool_create(pool);
-    for (rev = min_rev; rev <= max_rev; rev++) {
-        svn_pool_clear(subpool);
-        export_revision(rev, fs, subpool);
+    first_rev = min_rev;
+
+    // the revisions up to the saved state are in git already
+    svn_revnum_t start_rev = min_rev;
+    if ( has_state )
+    {
+        unsigned int saved_rev;
+        if ( !Repositories::loadState( saved_rev ) )
+            return 1;
+
+        start_rev = saved_rev + 1;
+        fprintf( stderr, "Resuming after revision %u.\n", saved_rev );
+    }
+
+    if ( !prune_dead_branches && !Repositories::prunedBranches().empty() )
+    {
+        Error::report( "The saved state has pruned branches, continue with --prune-dead-branches." );
+        return 1;
     }
 
+    // plan only what the saved plan does not have
+    if ( prune_dead_branches )
+    {
+        const char *uuid;
+        SVN_ERR(svn_fs_get_uuid(fs, &uuid, pool));
+
+        plan = new Plan( uuid, repos_config, min_rev );
+        if ( plan_fname )
+            plan->load( plan_fname );
+
+        bool complete = true;
+        if ( static_cast< svn_revnum_t >( plan->last() ) < max_rev )
+        {
+            fprintf( stderr, "Planning revisions %u..%ld...\n", plan->last() + 1, max_rev );
+            complete = plan_revisions( fs, max_rev, pool );
+            if ( plan_fname )
+                plan->save( plan_fname );
+        }
+
+        // a copy we have not seen could bring a branch back to life
+        if ( !complete )
+            Error::report( "Some revisions could not be planned, not pruning more dead branches." );
+        else
+            plan->findDeadBranches();
+
+        // what was pruned before is not in git, a copy from it in a new
+        // revision has to take the files from svn
+        plan->keepDead( Repositories::prunedBranches() );
+        Repositories::setPrunedBranches( plan->deadBranches() );
+        fprintf( stderr, "Pruning %u dead branches.\n", plan->deadCount() );
+    }
+
+    if ( prefetch_threads > 0 )
+        prefetcher = new Prefetcher( repos_path, start_rev, max_rev, prefetch_threads, target_name );
+
+    if ( !export_revisions( fs, start_rev, max_rev, pool ) )
+        ok = false;
+    else if ( resume && start_rev <= max_rev && !Repositories::saveState( max_rev ) )
+        ok = false;
+
+    // wait for the new revisions, and export them in batches
+    while ( ok && follow_seconds > 0 && !stop_following )
+    {
+        sleep( follow_seconds );
+        if ( stop_following )
+            break;
+
+        svn_revnum_t complete_rev;
+        if ( last_complete_rev( fs, complete_rev, pool ) != 0 )
+            break;
+        if ( complete_rev <= max_rev )
+            continue;
+
+        ok = fit_into_tables( complete_rev, table_revs );
+
+        if ( prefetcher )
+            prefetcher->extend( complete_rev );
+
+        const svn_revnum_t from = max_rev + 1;
+        max_rev = complete_rev;
+
+        if ( !export_revisions( fs, from, max_rev, pool ) )
+            break;
+
+        // make the batch visible in git right away
+        if ( resume )
+            Repositories::saveState( max_rev );
+        else
+            Repositories::checkpoint();
+    }
+
+    delete prefetcher;
+    prefetcher = NULL;
+
+    delete plan;
+    plan = NULL;
+
     svn_pool_destroy(pool);
 
     return 0;
 }
 
+/// Finish the current revision, and stop following the repository.
+static void stop_following_handler( int )
+{
+    stop_following = 1;
+}
+
+/// Only interrupts the sleep() between the polls.
+static void wake_up_handler( int )
+{
+}
+
 int main(int argc, char *argv[])
 {
-    if (argc != 4) {
-        Error::report( string( "usage: " ) + argv[0] + " REPOS_PATH committers.txt reposlayout.txt\n" );
+    bool has_target = false;
+    int arg = 1;
+    for ( ; arg < argc && strncmp( argv[arg], "--", 2 ) == 0; ++arg )
+    {
+        if ( strncmp( argv[arg], "--target=", 9 ) == 0 )
+        {
+            Repositories::setTarget( argv[arg] + 9 );
+            has_target = true;
+        }
+        else if ( strncmp( argv[arg], "--prefetch=", 11 ) == 0 )
+            prefetch_threads = atoi( argv[arg] + 11 );
+        else if ( strncmp( argv[arg], "--repos=", 8 ) == 0 )
+            Repositories::select( argv[arg] + 8 );
+        else if ( strcmp( argv[arg], "--prune-dead-branches" ) == 0 )
+            prune_dead_branches = true;
+        else if ( strncmp( argv[arg], "--plan=", 7 ) == 0 )
+            plan_fname = argv[arg] + 7;
+        else if ( strncmp( argv[arg], "--checkpoint=", 13 ) == 0 )
+            checkpoint_revs = atoi( argv[arg] + 13 );
+        else if ( strcmp( argv[arg], "--resume" ) == 0 )
+            resume = true;
+        else if ( strcmp( argv[arg], "--follow" ) == 0 )
+            follow_seconds = 10;
+        else if ( strncmp( argv[arg], "--follow=", 9 ) == 0 )
+            follow_seconds = atoi( argv[arg] + 9 );
+        else
+            break;
+    }
+
+    if ( argc - arg != 3 || checkpoint_revs <= 0 || ( resume && !has_target ) || ( follow_seconds > 0 && !has_target ) || ( plan_fname && !prune_dead_branches ) ) {
+        Error::report( string( "usage: " ) + argv[0] + " [--target=DIR [--resume] [--follow[=SECONDS]]] [--checkpoint=N] [--prune-dead-branches [--plan=FILE]] [--repos=NAME,...] [--prefetch=N] REPOS_PATH committers.txt reposlayout.txt\n\n"
+                "  --target=DIR    start git fast-import for each repository in DIR/<name>\n"
+                "                  instead of writing <name>.dump\n"
+                "  --resume        save the state to DIR at every checkpoint, and continue\n"
+                "                  after the last saved one when started again\n"
+                "  --follow[=S]    do not stop at the youngest revision, look for new ones\n"
+                "                  every S seconds (10 by default; SIGUSR1 looks right away,\n"
+                "                  SIGINT or SIGTERM finish)\n"
+                "  --checkpoint=N  checkpoint the output every N revisions (default 10000)\n"
+                "  --prune-dead-branches\n"
+                "                  skip the branches that were deleted, and nothing was\n"
+                "                  copied from them to the surviving branches or tags\n"
+                "  --plan=FILE     keep the branches found for --prune-dead-branches\n"
+                "                  in FILE for the next runs\n"
+                "  --repos=NAMES   write only these repositories (separated by commas)\n"
+                "  --prefetch=N    read the files of the next revisions in N threads" );
         return Error::returnValue();
     }
 
+    if ( resume )
+        Repositories::setResumable();
+
+    if ( follow_seconds > 0 )
+    {
+        struct sigaction action;
+        memset( &action, 0, sizeof( action ) );
+        sigemptyset( &action.sa_mask );
+
+        action.sa_handler = stop_following_handler;
+        sigaction( SIGINT, &action, NULL );
+        sigaction( SIGTERM, &action, NULL );
+
+        action.sa_handler = wake_up_handler;
+        sigaction( SIGUSR1, &action, NULL );
+    }
+
     if (apr_initialize() != APR_SUCCESS) {
         Error::report( "You lose at apr_initialize()." );
         return Error::returnValue();
     }
 
-    Committers::load( argv[2] );
+    Committers::load( argv[arg + 1] );
 
-    crawl_revisions( argv[1], argv[3] );
+    crawl_revisions( argv[arg], argv[arg + 2] );
 
     apr_terminate();
 
@@ -47,41 +47,29 @@ EOF
 fi
 
 mkdir -p "$TARGET"
-rm *.dump
-
-for I in `sed -e 's/^[#:].*//' -e 's/^ignore-.*//' -e 's/=.*//' "$LAYOUT" | grep -v '^$'` ; do
-    echo "$I" | sed 's/:/ /' | (
-        read NAME COMMIT
-        mkdir "$TARGET/$NAME"
-        mkfifo $NAME.dump
-        if [ -z "$COMMIT" -o -z "$FROM" ] ; then
-            ( cd "$TARGET/$NAME" ; git init ; git fast-import < "$WD"/$NAME.dump ) &
-        else
-            ( cd "$TARGET" ; git clone -n -l "$FROM/$NAME" "$NAME" ; \
-              cd "$NAME" ; git reset -q --hard "$COMMIT" ; git fast-import < "$WD"/$NAME.dump ; \
-              git checkout -f ) &
-        fi
-    )
-done
-
-# execute hg-fast-export, or svn-fast-export
-$COMMAND "$SOURCE" "$COMMITTERS" "$LAYOUT"
+
+# for incremental imports, start from the given commits
+if [ -n "$FROM" ] ; then
+    for I in `sed -e 's/^[#:].*//' -e 's/^ignore-.*//' -e 's/=.*//' "$LAYOUT" | grep -v '^$'` ; do
+        echo "$I" | sed 's/:/ /' | (
+            read NAME COMMIT
+            if [ -n "$COMMIT" ] ; then
+                ( cd "$TARGET" ; git clone -n -l "$FROM/$NAME" "$NAME" ; \
+                  cd "$NAME" ; git reset -q --hard "$COMMIT" )
+            fi
+        )
+    done
+fi
+
+# execute hg-fast-export, or svn-fast-export; it runs git fast-import for
+# every repository itself, waits for them, and removes the tag-branches/
+$COMMAND --target="$TARGET" "$SOURCE" "$COMMITTERS" "$LAYOUT"
 RETURN_VALUE=$?
 
-# wait until everything's finished
-while [ -n "`jobs`" ] ; do
-    echo jobs:
-    jobs
-    sleep 1
-done
-
-# wait one more minute for everything to settle down
-# FIXME rather find a real solution...
-sleep 60
-
-for I in `sed -e 's/^[#:].*//' -e 's/^ignore-.*//' -e 's/=.*//' -e 's/:.*//' "$LAYOUT" | grep -v '^$'` ; do
-    ( cd "$TARGET/$I" ; echo `pwd` ; git branch | sed 's/^\*/ /' | grep 'tag-branches/' | xargs git branch -D )
-    rm $I.dump
-done
+if [ -n "$FROM" ] ; then
+    for I in `sed -e 's/^[#:].*//' -e 's/^ignore-.*//' -e 's/=.*//' -e 's/:.*//' "$LAYOUT" | grep -v '^$'` ; do
+        ( cd "$TARGET/$I" ; git checkout -f )
+    done
+fi
 
 exit $RETURN_VALUE
@@ -0,0 +1,103 @@
+/*
+ * Walk a directory tree of a svn revision without recursion.
+ *
+ * Author: Jan Holesovsky <kendy@suse.cz>
+ * License: MIT <http://www.opensource.org/licenses/mit-license.php>
+ */
+
+#include "treewalk.hxx"
+
+#include <algorithm>
+
+#include <svn_pools.h>
+
+using namespace std;
+
+TreeWalk::TreeWalk( svn_fs_root_t* root_, const char* path_, apr_pool_t* pool_ )
+    : root( root_ ),
+      pool( svn_pool_create( pool_ ) ),
+      current( path_ ),
+      current_is_dir( false ),
+      descend( false ),
+      started( false )
+{
+}
+
+TreeWalk::~TreeWalk()
+{
+    svn_pool_destroy( pool );
+}
+
+svn_error_t* TreeWalk::next( bool& found_ )
+{
+    found_ = false;
+
+    if ( !started )
+    {
+        started = true;
+
+        svn_node_kind_t kind;
+        SVN_ERR( svn_fs_check_path( &kind, root, current.c_str(), pool ) );
+        if ( kind == svn_node_none )
+            return SVN_NO_ERROR;
+
+        current_is_dir = ( kind == svn_node_dir );
+        descend = current_is_dir;
+        found_ = true;
+
+        return SVN_NO_ERROR;
+    }
+
+    if ( descend )
+    {
+        descend = false;
+        SVN_ERR( readEntries() );
+    }
+
+    while ( !stack.empty() && stack.back().next >= stack.back().entries.size() )
+        stack.pop_back();
+
+    if ( stack.empty() )
+        return SVN_NO_ERROR;
+
+    Directory& dir = stack.back();
+    const Entry& entry = dir.entries[dir.next++];
+
+    current = dir.path + '/' + entry.name;
+    current_is_dir = entry.is_dir;
+    descend = current_is_dir;
+    found_ = true;
+
+    return SVN_NO_ERROR;
+}
+
+svn_error_t* TreeWalk::readEntries()
+{
+    stack.push_back( Directory() );
+    Directory& dir = stack.back();
+    dir.path = current;
+
+    apr_pool_t* subpool = svn_pool_create( pool );
+
+    apr_hash_t* entries;
+    SVN_ERR( svn_fs_dir_entries( &entries, root, current.c_str(), subpool ) );
+
+    dir.entries.reserve( apr_hash_count( entries ) );
+    for ( apr_hash_index_t* i = apr_hash_first( subpool, entries ); i; i = apr_hash_next( i ) )
+    {
+        void* val;
+        apr_hash_this( i, NULL, NULL, &val );
+        const svn_fs_dirent_t* dirent = static_cast< const svn_fs_dirent_t* >( val );
+
+        Entry entry;
+        entry.name = dirent->name;
+        entry.is_dir = ( dirent->kind == svn_node_dir );
+        dir.entries.push_back( entry );
+    }
+
+    svn_pool_destroy( subpool );
+
+    sort( dir.entries.begin(), dir.entries.end() );
+
+    return SVN_NO_ERROR;
+}
@@ -0,0 +1,85 @@
+/*
+ * Walk a directory tree of a svn revision without recursion.
+ *
+ * Author: Jan Holesovsky <kendy@suse.cz>
+ * License: MIT <http://www.opensource.org/licenses/mit-license.php>
+ */
+
+#ifndef _TREEWALK_HXX_
+#define _TREEWALK_HXX_
+
+#include <string>
+#include <vector>
+
+#include <svn_fs.h>
+
+/// Visits path_ and everything under it, in the order of the paths (the
+/// entries of each directory sorted by name), so the output does not depend
+/// on the hash order of svn.
+///
+/// Only the names and kinds of the directories on the way down are kept; the
+/// svn entries are read in a subpool per directory, and the subpool is
+/// destroyed right after that, so a walk through a big tree does not grow
+/// the caller's pool.
+class TreeWalk
+{
+    /// Directory entry, without the svn pool.
+    struct Entry
+    {
+        std::string name;
+        bool is_dir;
+
+        bool operator<( const Entry& other_ ) const { return name < other_.name; }
+    };
+
+    /// Directory we are walking through.
+    struct Directory
+    {
+        std::string path;
+        std::vector< Entry > entries;
+
+        /// Entry to visit next.
+        size_t next;
+
+        Directory() : next( 0 ) {}
+    };
+
+    svn_fs_root_t* root;
+
+    apr_pool_t* pool;
+
+    /// The directories from path_ down to the current node.
+    std::vector< Directory > stack;
+
+    std::string current;
+
+    bool current_is_dir;
+
+    /// Visit the entries of the current node in the next next().
+    bool descend;
+
+    /// Have we visited the path_ itself yet?
+    bool started;
+
+public:
+    TreeWalk( svn_fs_root_t* root_, const char* path_, apr_pool_t* pool_ );
+
+    ~TreeWalk();
+
+    /// Move to the next node; found_ is false when there are no more.
+    svn_error_t* next( bool& found_ );
+
+    /// Full path of the current node.
+    const std::string& path() const { return current; }
+
+    bool isDir() const { return current_is_dir; }
+
+    /// Do not visit the content of the current directory.
+    void skipChildren() { descend = false; }
+
+private:
+    /// Read the entries of the current directory to the top of the stack.
+    svn_error_t* readEntries();
+};
+
+#endif // _TREEWALK_HXX_